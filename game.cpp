@@ -1,31 +1,204 @@
+// Benchmark build (-DBENCHMARK), a headless build that times the physics step per level
+#ifdef BENCHMARK
+#define HEADLESS
+#endif
+
+// Offscreen build (-DOFFSCREEN), renders through OSMesa without a window and writes frames as images
+// Windowed Linux build (-DX11), an X11 window with a GLX context
+// Headless, offscreen and X11 builds run on Linux, without Win32
+#if defined( HEADLESS ) || defined( OFFSCREEN ) || defined( X11 )
+#define LINUX
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+
+#ifdef LINUX
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#else
 #include <windows.h>
+#endif
 #include <math.h>
 
+// SSE2 terrain kernel, the scalar fallback is used on other targets
+#if defined( __SSE2__ ) || defined( _M_X64 ) || (defined( _M_IX86_FP ) && _M_IX86_FP >= 2)
+#define TERRAIN_SSE
+#include <emmintrin.h>
+#endif
+
+#ifndef HEADLESS
 #define GLEW_STATIC
+#ifdef OFFSCREEN
+#define GLEW_OSMESA
+#endif
 #include <GL/glew.h>
 #include <GL/gl.h>
 #include <GL/glu.h>
+#ifdef OFFSCREEN
+#include <GL/osmesa.h>
+#endif
+#ifdef X11
+#include <X11/Xlib.h>
+#include <X11/XKBlib.h>
+#include <X11/keysym.h>
+#include <GL/glx.h>
+#endif
+#endif
 
 #include <chipmunk.h>
 
+#ifndef HEADLESS
 #include "shaders.h"
+#endif
+
+// Linux builds, the headless build (-DHEADLESS) runs the simulation without Win32 or OpenGL
+#ifdef LINUX
+typedef unsigned long DWORD;
+
+#define TRUE		1
+#define FALSE		0
+#define INFINITE	0xFFFFFFFF
+
+// Win32 virtual key codes used by the game, the X11 backend translates to these
+#define VK_SHIFT	0x10
+#define VK_ESCAPE	0x1B
+#define VK_SPACE	0x20
+#define VK_LEFT		0x25
+#define VK_RIGHT	0x27
+#define VK_F1		0x70
+#define VK_F2		0x71
+#define VK_F3		0x72
+#define VK_F4		0x73
+
+// Redefined below as float
+#undef M_PI
+
+// Errors go to stderr instead of a message box
+#define MB_OK				0x00
+#define MB_ICONEXCLAMATION	0x30
+#define MB_ICONINFORMATION	0x40
+
+inline int MessageBox( void* hWnd, const char* szText, const char* szCaption, unsigned int nType )
+{
+	fprintf( stderr, "%s: %s\n", szCaption, szText );
+	return 0;
+}
+
+#define wvsprintf			vsprintf
+#define MAX_PATH			260
+
+// High resolution time in seconds since an arbitrary point in time
+double GetTime( void )
+{
+	timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+
+	return double( ts.tv_sec ) + double( ts.tv_nsec ) * 1e-9;
+}
+
+// Worker threads
+typedef pthread_t		Thread;
+typedef pthread_mutex_t	Mutex;
+typedef pthread_cond_t	Condition;
+typedef void*			ThreadResult;
+
+#define THREAD_CALL
+
+inline void CreateWorkerThread( Thread & thread, ThreadResult (*pFunc)( void* ), void* pData )	{ pthread_create( &thread, NULL, pFunc, pData ); }
+inline void JoinWorkerThread( Thread & thread )			{ pthread_join( thread, NULL ); }
+inline void InitMutex( Mutex & mutex )					{ pthread_mutex_init( &mutex, NULL ); }
+inline void DestroyMutex( Mutex & mutex )				{ pthread_mutex_destroy( &mutex ); }
+inline void LockMutex( Mutex & mutex )					{ pthread_mutex_lock( &mutex ); }
+inline void UnlockMutex( Mutex & mutex )				{ pthread_mutex_unlock( &mutex ); }
+inline void InitCondition( Condition & condition )		{ pthread_cond_init( &condition, NULL ); }
+inline void DestroyCondition( Condition & condition )	{ pthread_cond_destroy( &condition ); }
+inline void WaitCondition( Condition & condition, Mutex & mutex )	{ pthread_cond_wait( &condition, &mutex ); }
+inline void WakeCondition( Condition & condition )		{ pthread_cond_broadcast( &condition ); }
+#else
+// High resolution time in seconds since an arbitrary point in time
+double GetTime( void )
+{
+	static LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+
+	if( !frequency.QuadPart )
+	{
+		QueryPerformanceFrequency( &frequency );
+	}
+
+	QueryPerformanceCounter( &counter );
+
+	return double( counter.QuadPart ) / double( frequency.QuadPart );
+}
+
+// Worker threads, condition variables need Windows Vista
+typedef HANDLE				Thread;
+typedef CRITICAL_SECTION	Mutex;
+typedef CONDITION_VARIABLE	Condition;
+typedef DWORD				ThreadResult;
+
+#define THREAD_CALL			WINAPI
+
+inline void CreateWorkerThread( Thread & thread, ThreadResult (WINAPI *pFunc)( void* ), void* pData )	{ thread = CreateThread( NULL, 0, pFunc, pData, 0, NULL ); }
+inline void JoinWorkerThread( Thread & thread )			{ WaitForSingleObject( thread, INFINITE ); CloseHandle( thread ); }
+inline void InitMutex( Mutex & mutex )					{ InitializeCriticalSection( &mutex ); }
+inline void DestroyMutex( Mutex & mutex )				{ DeleteCriticalSection( &mutex ); }
+inline void LockMutex( Mutex & mutex )					{ EnterCriticalSection( &mutex ); }
+inline void UnlockMutex( Mutex & mutex )				{ LeaveCriticalSection( &mutex ); }
+inline void InitCondition( Condition & condition )		{ InitializeConditionVariable( &condition ); }
+inline void DestroyCondition( Condition & condition )	{ }
+inline void WaitCondition( Condition & condition, Mutex & mutex )	{ SleepConditionVariableCS( &condition, &mutex, INFINITE ); }
+inline void WakeCondition( Condition & condition )		{ WakeAllConditionVariable( &condition ); }
+#endif
 
 // Constants
 #define MAX_VEHICLE_WHEELS		4		// Array boundary
-#define MAX_VEHICLES			100		// Array boundary
-#define MAX_ROCKS				100		// Array boundary
+#define MAX_VEHICLE_TYPES		16		// Array boundary, carType is 4 bits
 
 #define COUNT_WHEELS_CAR		2		// #wheels for a car
 #define COUNT_WHEELS_TRAILER	3		// #wheels for a trailer
 
 #define	TERRAIN_WIDTH			50		// Terrain width in world coordinates
 #define	TERRAIN_SEGMENTS		200		// Terrain width in number of (physics) segments
+#define TERRAIN_FREQUENCY		(M_PI / 10.0f)	// Heightmap phase per segment
+#define TERRAIN_CHUNK_SEGMENTS	32		// Segments per terrain chunk
+#define TERRAIN_MAX_CHUNKS		8		// Terrain chunks loaded at most
+#define TERRAIN_STREAM_DISTANCE	8.0f	// Terrain is loaded this far around the camera
+#define TERRAIN_PREFETCH_CHUNKS	2		// Chunks generated ahead of the loaded terrain
+#define TERRAIN_MAX_JOBS		6		// Chunks generated in advance at most
+#define TERRAIN_WORKERS			2		// Terrain generation threads
+
+#define LEVEL_START				12						// Segment the player character starts at
+#define LEVEL_FINISH			(TERRAIN_SEGMENTS - 10)	// Segment of the finish line
+#define LEVEL_RIGHT				(TERRAIN_SEGMENTS - 1)	// Segment of the right boundary
+#define LEVEL_SCROLL_MIN		10						// Segments the camera keeps from the boundaries
+#define LEVEL_SCROLL_MAX		(TERRAIN_SEGMENTS - 9)
 #define	WORLD_SCALE				0.14f	// Scale of objects in world coordinates
 
+#define CAMERA_FOV				45.0f				// Vertical field of view in degrees
+#define CAMERA_HEIGHT			1.0f				// Camera height above the road
+#define CAMERA_DISTANCE			4.7f				// Camera distance to the road
+#define CULL_DEPTH				1.0f				// Depth of the drawn shapes behind the road
+#define CULL_DEPTH_MOUNTAIN		2.0f				// Depth of the back of the mountains behind the road
+#define CULL_MARGIN				(WORLD_SCALE * 2)	// Covers interpolation of the hashed bounding boxes
+
 #define PLAYER_W_LIMIT			1.8f				// Player character rotational limit
 #define CAMERA_FOLLOW_MIN		-(WORLD_SCALE * 1)	// Margin between the player character and the camera
 #define CAMERA_FOLLOW_MAX		(WORLD_SCALE * 1)
 
+#define PHYSICS_RATE			60.0f	// Physics ticks per second
+#define PHYSICS_SUBSTEPS		5		// Chipmunk steps per physics tick
+#define PHYSICS_MAX_TICKS		5		// Physics ticks to catch up per frame at most
+
+#define SCORE_COMBO_TICKS		18		// Physics ticks between kills to raise the multiplier
+
+#define SLEEP_IDLE_SPEED		(WORLD_SCALE * 0.1f)	// Bodies slower than this are idle
+#define SLEEP_IDLE_TICKS		30						// Idle physics ticks before falling asleep
+#define NPC_ACTIVE_DISTANCE		5.0f					// Npc's further from the camera do not drive
+
 // Types and structs
 struct VertexData
 {
@@ -39,27 +212,99 @@ struct HeightData
 	cpFloat y, a;
 };
 
+// Terrain layers, a layer is a heightmap with a front and a top strip
+#define TERRAIN_ROAD			0
+#define TERRAIN_MOUNTAIN		1
+#define COUNT_TERRAIN_LAYERS	2
+
+struct TerrainLayerData
+{
+	float			fBase;			// Height offset
+	float			fPeriod;
+	float			fFrontY;		// Bottom of the front strip
+	float			fFrontZ;
+	cpCollisionType	collisionType;
+	bool			bSensor;
+};
+
+// Terrain segments and the bottom boundary of a chunk
+#define COUNT_CHUNK_SHAPES		(COUNT_TERRAIN_LAYERS * TERRAIN_CHUNK_SEGMENTS + 1)
+
+struct TerrainChunk
+{
+	int				nChunk;			// Position along the level, -1 for a free slot
+	int				nFirst;			// First and last vertex of the chunk, shared with neighbours
+	int				nLast;
+	cpShape*		shapes[COUNT_CHUNK_SHAPES];
+	unsigned int	nShapes;
+#ifndef HEADLESS
+	GLuint			buffers[COUNT_TERRAIN_LAYERS * 2];	// Front and top strip of every layer
+#endif
+};
+
+// States of terrain jobs
+#define JOB_FREE				0
+#define JOB_QUEUED				1
+#define JOB_BUSY				2		// Being generated by a worker or the main thread
+#define JOB_DONE				3
+
+// A terrain chunk generated in advance, ready to be loaded
+struct TerrainJob
+{
+	int				nChunk;			// -1 for a free job
+	unsigned int	nState;
+	int				nFirst;
+	int				nLast;
+	cpVect			points[COUNT_TERRAIN_LAYERS][TERRAIN_CHUNK_SEGMENTS + 1];
+#ifndef HEADLESS
+	VertexData		front[COUNT_TERRAIN_LAYERS][(TERRAIN_CHUNK_SEGMENTS + 1) * 2];
+	VertexData		top[COUNT_TERRAIN_LAYERS][(TERRAIN_CHUNK_SEGMENTS + 1) * 2];
+#endif
+};
+
+// Handle to an entity in a pool, the index of its slot and the generation of that slot
+typedef unsigned int Handle;
+
+#define HANDLE_NONE				0
+#define HANDLE_INDEX( h )		((h) & 0xFFFF)
+#define HANDLE_GENERATION( h )	((h) >> 16)
+
+// Handles are stored in the user data of physics shapes
+#define SHAPE_HANDLE( shape )	((Handle)(size_t)(shape)->data)
+#define HANDLE_DATA( h )		((void*)(size_t)(h))
+
 struct WheelData
 {
 	cpShape*		wheel;
 	cpConstraint*	spring;
 	cpConstraint*	joint;
 	bool			attached;
+	Handle			vehicle;
 };
 
 struct VehicleData
 {
 	cpShape*		chassis;
-	cpConstraint*	link;
-	WheelData		wheel[MAX_VEHICLE_WHEELS];
+	cpConstraint*	link;			// Constraints to the vehicle it is towed by
+	cpConstraint*	linkLimit;
+	cpConstraint*	linkGroove;
+	Handle			linkVehicle;
+	Handle			wheel[MAX_VEHICLE_WHEELS];
 
 	unsigned int	carType : 4;
 	unsigned int	npc : 1;
+	unsigned int	dead : 1;
+	unsigned int	sleeping : 1;
+	unsigned int	wake : 1;		// Hit while sleeping, woken after the step
+	unsigned char	idleTicks;
 };
 
 struct RockData
 {
 	cpShape*		rock;
+	bool			sleeping;
+	bool			wake;
+	unsigned char	idleTicks;
 };
 
 struct CameraData
@@ -68,6 +313,149 @@ struct CameraData
 	cpShape*		player;
 };
 
+// Growable pool of entities, all slots are kept in one array and freed slots are
+// reused. The generation of a slot is odd while in use and changes on every
+// allocation and free, so handles to a freed entity no longer resolve.
+template <class T>
+struct Pool
+{
+	T*					pData;
+	unsigned short*		pGeneration;
+	unsigned short*		pFree;			// Stack of free slot indices below nSlots
+	unsigned int		nFree;
+	unsigned int		nSlots;			// Slots in use or freed, iterate up to this
+	unsigned int		nMax;
+};
+
+#define MAX_POOL_SLOTS		0x10000		// Index is 16 bits in a handle
+
+// Allocate a zeroed entity and return its handle, HANDLE_NONE if the pool is full
+template <class T>
+Handle PoolAlloc( Pool<T> & pool )
+{
+	unsigned int i;
+
+	if( pool.nFree )
+	{
+		i = pool.pFree[--pool.nFree];
+	}
+	else
+	{
+		if( pool.nSlots == pool.nMax )
+		{
+			// Grow, keeping the generations of all slots
+			unsigned int nMax = ( pool.nMax ? pool.nMax * 2 : 64 );
+			if( nMax > MAX_POOL_SLOTS ) nMax = MAX_POOL_SLOTS;
+			if( nMax == pool.nMax ) return HANDLE_NONE;
+
+			T* pData = new T[nMax];
+			unsigned short* pGeneration = new unsigned short[nMax];
+			unsigned short* pFree = new unsigned short[nMax];
+
+			memset( pGeneration, 0, nMax * sizeof( unsigned short ) );
+
+			if( pool.nMax )
+			{
+				memcpy( pData, pool.pData, pool.nMax * sizeof( T ) );
+				memcpy( pGeneration, pool.pGeneration, pool.nMax * sizeof( unsigned short ) );
+
+				delete[] pool.pData;
+				delete[] pool.pGeneration;
+				delete[] pool.pFree;
+			}
+
+			pool.pData = pData;
+			pool.pGeneration = pGeneration;
+			pool.pFree = pFree;
+			pool.nMax = nMax;
+		}
+
+		i = pool.nSlots++;
+	}
+
+	memset( &pool.pData[i], 0, sizeof( T ) );
+	++pool.pGeneration[i];
+
+	return (Handle( pool.pGeneration[i] ) << 16) | i;
+}
+
+// Entity a handle refers to, NULL if it was freed
+template <class T>
+T* PoolGet( Pool<T> & pool, Handle h )
+{
+	unsigned int i = HANDLE_INDEX( h );
+
+	if( h == HANDLE_NONE || i >= pool.nSlots || pool.pGeneration[i] != HANDLE_GENERATION( h ) )
+	{
+		return NULL;
+	}
+
+	return &pool.pData[i];
+}
+
+// Check if the slot at index i holds an entity
+template <class T>
+bool PoolIsLive( const Pool<T> & pool, unsigned int i )
+{
+	return (pool.pGeneration[i] & 1) != 0;
+}
+
+// Handle of the entity in the slot at index i
+template <class T>
+Handle PoolHandle( const Pool<T> & pool, unsigned int i )
+{
+	return (Handle( pool.pGeneration[i] ) << 16) | i;
+}
+
+// Free an entity, its slot is reused by the next allocation
+template <class T>
+void PoolFree( Pool<T> & pool, Handle h )
+{
+	if( PoolGet( pool, h ) )
+	{
+		unsigned int i = HANDLE_INDEX( h );
+
+		++pool.pGeneration[i];
+		pool.pFree[pool.nFree++] = i;
+	}
+}
+
+// Free all entities while keeping the memory
+template <class T>
+void PoolReset( Pool<T> & pool )
+{
+	unsigned int i;
+
+	for( i = 0; i < pool.nSlots; ++i )
+	{
+		if( PoolIsLive( pool, i ) )
+		{
+			++pool.pGeneration[i];
+		}
+	}
+
+	pool.nSlots = 0;
+	pool.nFree = 0;
+}
+
+// Release the memory of a pool
+template <class T>
+void PoolDestroy( Pool<T> & pool )
+{
+	delete[] pool.pData;
+	delete[] pool.pGeneration;
+	delete[] pool.pFree;
+
+	memset( &pool, 0, sizeof( pool ) );
+}
+
+struct BodyState
+{
+	cpBody*			body;
+	cpVect			p, pTick;		// Position before and after the last physics tick
+	cpFloat			a, aTick;		// Angle before and after the last physics tick
+};
+
 // World to be used for physics
 cpSpace* space;
 cpBody*  bounds;
@@ -79,14 +467,28 @@ CameraData		g_Camera;
 // Global physics objects
 unsigned int	g_nNpcVehicles;
 unsigned int	g_nPcVehicles;
-unsigned int	g_nVehicles;
-unsigned int	g_nRocks;
-VehicleData*	g_pVehicles;
-RockData*		g_pRocks;
+Pool<VehicleData>	g_Vehicles;
+Pool<WheelData>		g_Wheels;
+Pool<RockData>		g_Rocks;
+Handle				g_hPcVehicle;
+
+// Fixed timestep
+unsigned int	g_nPhysicsTick;
+double			g_dPhysicsTime;
+double			g_dPhysicsAccumulator;
+cpFloat			g_fPhysicsAlpha;
+BodyState*		g_pBodyStates;
+unsigned int	g_nBodyStates;
+unsigned int	g_nMaxBodyStates;
+
+// Sleeping bodies
+bool			g_bSleeping = true;		// Settled groups leave the space, the benchmark compares both
+bool			g_bWakeQueued;
 
 // Misc. Variables
 float			g_fBoost;
 float			g_fTerrainStep;
+unsigned int	g_nWorldSeed;		// Seeds the random numbers of every level
 
 // Physics groups
 #define	GROUP_DEFAULT	0
@@ -98,38 +500,229 @@ float			g_fTerrainStep;
 #define	HANDLING_BRAKE		1
 #define	HANDLING_BOOST		2
 
-// Height map data
-HeightData* g_pRoadHeightMap;
-HeightData* g_pMountainHeightMap;
+// Terrain chunks, and the jobs generating them on worker threads
+TerrainChunk	g_TerrainChunks[TERRAIN_MAX_CHUNKS];
+TerrainJob		g_TerrainJobs[TERRAIN_MAX_JOBS];		// Shared with the workers, guarded by the mutex
+TerrainJob		g_TerrainLocalJob;						// Chunks needed before a worker got to them
+Thread			g_TerrainWorkers[TERRAIN_WORKERS];
+Mutex			g_TerrainMutex;
+Condition		g_TerrainCondition;
+bool			g_bTerrainQuit;
 
 // Scroll position
 float g_fXScroll;
+float g_fViewAspect = 1.0f;
+
+// Bools indicating keys pressed, active window and fullscreen
+bool g_bKeys[256];
+bool g_bKeyLock;
+bool g_bActiveWindow;
 
+#ifndef HEADLESS
+#if defined( X11 )
+// Window handlers
+Display*	g_pDisplay;
+Window		g_Window;
+GLXContext	g_Context;
+Atom		g_WmDeleteWindow;
+#elif !defined( OFFSCREEN )
 // Window handlers
 HDC			hDC;
 HGLRC		hRC;
 HWND		hWnd;
 HINSTANCE	hInstance;
+#endif
 
-// Bools indicating keys pressed, active window and fullscreen
-bool g_bKeys[256];
-bool g_bKeyLock;
-bool g_bActiveWindow;
+#ifndef OFFSCREEN
+// Platform layer, implemented by the Win32 and X11 window backends
+int  CreateGLWindow( char* title, int width, int height, int bits, bool fullscreen );
+GLvoid KillGLWindow( GLvoid );
+bool HandleWindowEvents( void );	// False when the window is closed
+void SwapGLBuffers( void );
+#endif
 
 // OpenGL declarations
 GLuint textures[3];
-GLuint buffers[4];
-GLuint programLighting, programEdge;
+
+// Shader programs
+#define PROGRAM_LIGHTING	0
+#define PROGRAM_EDGE		1
+#define PROGRAM_INSTANCED	2
+#define PROGRAM_EDGE_HALF	3
+#define PROGRAM_EDGE_COMPOSITE	4
+#define COUNT_PROGRAMS		5
+
+// Shader uniforms, locations are resolved once per program at link time
+#define UNIFORM_TEX			0
+#define UNIFORM_TEX_COLOR	1
+#define UNIFORM_TEX_GBUFFER	2
+#define UNIFORM_TEX_EDGE	3
+#define UNIFORM_TEXEL_SIZE	4
+#define UNIFORM_TEX_MAX		5
+#define COUNT_UNIFORMS		6
+
+struct UniformData
+{
+	const GLchar*	szName;
+	GLint			nSampler;		// Texture unit bound at link time, -1 if not a sampler
+};
+
+const UniformData uniformData[COUNT_UNIFORMS] = {
+	{ "tex",		0 },
+	{ "texColor",	0 },
+	{ "texGBuffer",	1 },
+	{ "texEdge",	2 },
+	{ "texelSize",	-1 },
+	{ "texMax",		-1 }
+};
+
+struct ProgramData
+{
+	GLint			nVertexSize;
+	const GLchar*	szVertexShader;
+	GLint			nFragmentSize;
+	const GLchar*	szFragmentShader;
+
+	GLuint			program;
+	GLint			uniforms[COUNT_UNIFORMS];
+};
+
+ProgramData programs[COUNT_PROGRAMS] = {
+	{ sizeof(vertexShaderDefault),   vertexShaderDefault,   sizeof(fragmentShaderScene), fragmentShaderScene },
+	{ sizeof(vertexShaderDefault),   vertexShaderDefault,   sizeof(fragmentShaderEdge),  fragmentShaderEdge },
+	{ sizeof(vertexShaderInstanced), vertexShaderInstanced, sizeof(fragmentShaderScene), fragmentShaderScene },
+	{ sizeof(vertexShaderDefault),   vertexShaderDefault,   sizeof(fragmentShaderEdgeHalf),      fragmentShaderEdgeHalf },
+	{ sizeof(vertexShaderDefault),   vertexShaderDefault,   sizeof(fragmentShaderEdgeComposite), fragmentShaderEdgeComposite }
+};
+
+// Program object of a registered program, 0 if it failed to build
+inline GLuint GetProgram( unsigned int nProgram )
+{
+	return programs[nProgram].program;
+}
+
+// Cached uniform location of a registered program, -1 if unused
+inline GLint GetUniform( unsigned int nProgram, unsigned int nUniform )
+{
+	return programs[nProgram].uniforms[nUniform];
+}
 
 GLuint fontList;
 
-GLuint textureDepth;
-GLuint textureColor;
-GLuint textureNormal;
-GLuint fbo;
+// Render targets, attachments are allocated in size buckets larger than the window. Resizing
+// within a bucket only changes the viewport and scissor, the texture coordinates of the passes
+// are scaled to the part in use
+#define TARGET_SCENE			0	// Colour and G-buffer (octahedral normal and linear depth, see shaders.h)
+#define TARGET_EDGE				1	// Half resolution edge intensity
+#define COUNT_TARGETS			2
+
+#define MAX_TARGET_COLORS		2
+#define TARGET_BUCKET			256
+
+struct TargetFormat
+{
+	GLint			nInternalFormat;
+	GLint			nFilter;
+};
+
+struct RenderTarget
+{
+	unsigned int	nColors;
+	TargetFormat	formats[MAX_TARGET_COLORS];
+	bool			bDepth;
+	GLsizei			nDivisor;		// Of the allocated screen size
+
+	GLuint			fbo;
+	GLuint			textures[MAX_TARGET_COLORS];
+	GLuint			depthBuffer;
+	GLsizei			nWidth;			// Allocated size
+	GLsizei			nHeight;
+};
+
+// The G-buffer uses nearest filtering, blending the split depth bytes of neighbouring texels gives garbage
+RenderTarget renderTargets[COUNT_TARGETS] = {
+	{ 2, { { GL_RGBA8, GL_LINEAR }, { GL_RGBA8, GL_NEAREST } }, true,  1 },
+	{ 1, { { GL_RGBA8, GL_LINEAR } },                           false, 2 }
+};
+
+// Part of the render targets in use, in texture coordinates
+GLfloat g_fTargetScale[2] = { 1.0f, 1.0f };
+
+// Resize events are coalesced and applied once before the next frame
+bool	g_bResizePending;
+GLsizei	g_nResizeWidth;
+GLsizei	g_nResizeHeight;
+
+inline GLuint GetTargetTexture( unsigned int nTarget, unsigned int nColor )
+{
+	return renderTargets[nTarget].textures[nColor];
+}
+
+// Edge pass quality tiers, F4 cycles through them
+#define EDGE_QUALITY_AUTO		0	// Full, half resolution above EDGE_HALF_PIXELS
+#define EDGE_QUALITY_FULL		1	// Full resolution
+#define EDGE_QUALITY_HALF		2	// Half resolution, upsampled onto the colour
+#define COUNT_EDGE_QUALITY		3
+
+#define EDGE_HALF_PIXELS		(2560 * 1440)
+
+unsigned int g_nEdgeQuality;
+
+GLsizei g_nViewWidth;
+GLsizei g_nViewHeight;
 
 GLubyte data[3][256][256][4];
 
+// Static meshes, built once in InitGL
+struct MeshData
+{
+	GLuint		vertexBuffer;
+	GLuint		indexBuffer;
+	GLsizei		nIndices;
+};
+
+MeshData meshRock;
+MeshData meshWheel;
+MeshData meshChassis[MAX_VEHICLE_TYPES];
+MeshData meshClouds;
+
+// Per-instance data for instanced rendering, collected every frame
+struct InstanceData
+{
+	GLfloat x, y, z, a;
+	GLfloat scale, flip;
+};
+
+struct InstanceList
+{
+	InstanceData*	pData;
+	unsigned int	nCount;
+	unsigned int	nMax;
+};
+
+InstanceList instancesRock;
+InstanceList instancesWheel;
+InstanceList instancesChassis[MAX_VEHICLE_TYPES];
+
+GLint  attribInstancePosition, attribInstanceScale;
+bool   g_bInstancing;
+
+// Streaming vertex buffer ring, dynamic per frame data is appended and drawn from it. When the ring
+// is full its storage is orphaned, the GPU keeps reading the old storage and the CPU never waits on it
+#define STREAM_BUFFER_SIZE	(256 * 1024)
+#define STREAM_BUFFER_ALIGN	64
+
+struct StreamBuffer
+{
+	GLuint		buffer;
+	GLsizeiptr	nSize;
+	GLsizeiptr	nOffset;
+};
+
+StreamBuffer streamBuffer;
+bool   g_bMapBufferRange;
+
+#ifndef LINUX
 // Forward declaration of WndProc
 LRESULT	CALLBACK WndProc( HWND, UINT, WPARAM, LPARAM );
 
@@ -139,11 +732,13 @@ typedef int  (*PFNWGLEXTGETSWAPINTERVALPROC)      (void);
  
 PFNWGLEXTSWAPCONTROLPROC     wglSwapIntervalEXT	   = NULL;
 PFNWGLEXTGETSWAPINTERVALPROC wglGetSwapIntervalEXT = NULL;
+#endif
+#endif
 
 // Score count
 int				g_nScore;
 float			g_fMultiplier;
-DWORD			g_dwLastScoreTime;
+unsigned int	g_nLastScoreTick;
 unsigned int	g_nLevel;
 
 // Stride macro
@@ -193,1941 +788,4981 @@ unsigned int _rand( void )
 }
 
 ///***********************************************************///
-/// Update physics routines
+/// Profiler
 ///***********************************************************///
 
-// Post step callback, for safe removal of bodies
-static void RemoveBody( cpSpace *space, cpShape *shape, void *data )
+// Profiler sections, CPU times are summed over a frame
+#define PROFILE_STEP		0									// One section per substep
+#define PROFILE_NPC			(PROFILE_STEP + PHYSICS_SUBSTEPS)
+#define PROFILE_WORLD		(PROFILE_NPC + 1)
+#define PROFILE_EDGE		(PROFILE_NPC + 2)
+#define PROFILE_HUD			(PROFILE_NPC + 3)
+#define PROFILE_GPU_SCENE	(PROFILE_NPC + 4)					// GPU time of the scene pass
+#define PROFILE_GPU_EDGE	(PROFILE_NPC + 5)					// GPU time of the edge pass
+#define PROFILE_FRAME		(PROFILE_NPC + 6)
+#define COUNT_PROFILE		(PROFILE_NPC + 7)
+
+#define COUNT_GPU_PROFILE	2
+
+const char* profileNames[COUNT_PROFILE - PROFILE_NPC] = { "npc", "world", "edge", "hud", "gpu_scene", "gpu_edge", "frame" };
+
+double			g_dProfileStart[COUNT_PROFILE];
+double			g_dProfileTime[COUNT_PROFILE];		// Seconds spent this frame
+double			g_dProfileLast[COUNT_PROFILE];		// Seconds spent in the last frame
+double			g_dProfileFrameStart;
+unsigned int	g_nProfileFrame;
+bool			g_bProfileOverlay;
+FILE*			g_pProfileLog;
+
+// Name of a profiler section, the buffer is used for substep names
+const char* GetProfileName( unsigned int nSection, char* szBuffer )
 {
-	cpSpaceRemoveShape( space, shape );
-	cpShapeFree( shape );
+	if( nSection < PROFILE_NPC )
+	{
+		sprintf( szBuffer, "step%u", nSection - PROFILE_STEP );
+		return szBuffer;
+	}
+
+	return profileNames[nSection - PROFILE_NPC];
 }
 
-// Post step callback, for safe addition of bodies
-static void AddBody( cpSpace *space, cpShape *shape, void *data )
+inline void ProfileBegin( unsigned int nSection )
 {
-    cpSpaceAddBody(space, shape->body);
-        
-    cpSpaceAddShape(space, shape);
+	g_dProfileStart[nSection] = GetTime();
 }
 
-void UpdateScore()
+inline void ProfileEnd( unsigned int nSection )
+{
+	g_dProfileTime[nSection] += GetTime() - g_dProfileStart[nSection];
+}
+
+// Start streaming a line per frame with all section times in ms to a CSV file
+bool OpenProfileLog( const char* szFileName )
 {
-	int currentTime = GetTickCount();
-	int scoreTimeDifference = currentTime  - g_dwLastScoreTime;
+	char szName[16];
+	unsigned int i;
 
-	if( scoreTimeDifference <= 300 )
+	if( !(g_pProfileLog = fopen( szFileName, "w" )) )
 	{
-		g_fMultiplier += 0.2f;
+		return false;
 	}
-	else
+
+	fprintf( g_pProfileLog, "frame" );
+	for( i = 0; i < COUNT_PROFILE; ++i )
 	{
-		g_fMultiplier = 1.0f;
+		fprintf( g_pProfileLog, ",%s", GetProfileName( i, szName ) );
 	}
+	fprintf( g_pProfileLog, "\n" );
 
-	g_nScore += (10.0f * int( g_fMultiplier ));
-
-	g_dwLastScoreTime = currentTime;
+	return true;
 }
 
-// Apply impulse to non-player character, call every frame to let npc's move
-void NpcApplyImpulse()
+void CloseProfileLog( void )
 {
-	for( int i = 0 ; i < g_nVehicles; ++i )
+	if( g_pProfileLog )
 	{
-		if( g_pVehicles[i].npc )
-		{
-			cpBody* pBody = g_pVehicles[i].chassis->body;
-			cpBodyApplyImpulse( pBody, cpv( -WORLD_SCALE * 0.25f + fmod( pBody->a, M_PI / 2.0 ) / M_PI * 0.15f, 0.0f ), cpvzero );
-		}
+		fclose( g_pProfileLog );
+		g_pProfileLog = NULL;
 	}
 }
 
-void HandlePcVehicle( const unsigned int handlingType )
+#ifndef HEADLESS
+// GPU timer queries, double buffered so results are read a frame later without stalling
+GLuint			gpuQueries[2][COUNT_GPU_PROFILE];
+bool			g_bGpuQueriesIssued[2];
+bool			g_bTimerQuery;
+
+void InitGpuProfile( void )
 {
-	cpBody* pPcCar = g_pVehicles[0].chassis->body;
-	
-	if( handlingType == HANDLING_ACCELERATE )
-	{	// Accelerate
-		if( pPcCar->v.x < WORLD_SCALE * 25.0f )
-		{
-			cpBodyApplyImpulse( pPcCar, cpv( (WORLD_SCALE * 0.20f + pPcCar->a / M_PI * 0.15f) * (g_nPcVehicles * 1.50f), 0.0f ), cpvzero );
-		}
-	}
-	else if( handlingType == HANDLING_BRAKE )
-	{	// Brake
-		if( pPcCar->v.x > 0 )
-		{
-			cpBodyApplyImpulse( pPcCar, cpv( -WORLD_SCALE * 0.5, 0.0f ), cpvzero );
-		}
-	}
-	else if( handlingType == HANDLING_BOOST )
-	{	// Rocket boost
-		g_fBoost = 0.01f;
+	g_bTimerQuery = ( glewIsSupported( "GL_ARB_timer_query" ) == GL_TRUE );
+
+	if( g_bTimerQuery )
+	{
+		glGenQueries( 2 * COUNT_GPU_PROFILE, &gpuQueries[0][0] );
 	}
 }
 
-// Kills a rock
-static void KillRock( RockData * pRock )
+inline void ProfileBeginGpu( unsigned int nSection )
 {
-	pRock->rock->layers = LAYER_BOTTOM;
+	if( g_bTimerQuery )
+	{
+		glBeginQuery( GL_TIME_ELAPSED, gpuQueries[g_nProfileFrame & 1][nSection - PROFILE_GPU_SCENE] );
+	}
 }
 
-// Kills a vehicle
-static void KillVehicle( VehicleData * pVehicleData )
+inline void ProfileEndGpu( unsigned int nSection )
 {
-	int i;
-
-	pVehicleData->chassis->layers = LAYER_BOTTOM;
-
-	for( i = 0; i < MAX_VEHICLE_WHEELS; ++i )
+	if( g_bTimerQuery )
 	{
-		if( pVehicleData->wheel[i].wheel )
-			pVehicleData->wheel[i].wheel->layers = LAYER_BOTTOM;
+		glEndQuery( GL_TIME_ELAPSED );
+		g_bGpuQueriesIssued[g_nProfileFrame & 1] = true;
 	}
 }
 
-static int KillNpcHandler( cpArbiter* pArbiter, struct cpSpace* pSpace, void* pData )
+// Collect the GPU times of the previous frame, if the GPU finished them
+void ReadGpuProfile( void )
 {
-	int i;
-
-	CP_ARBITER_GET_SHAPES( pArbiter, a, b );
+	unsigned int nPrevious = (g_nProfileFrame + 1) & 1;
+	unsigned int i;
 
-	if( a->collision_type == T_WHEEL || a->collision_type == T_CHASSIS )
+	if( !g_bTimerQuery || !g_bGpuQueriesIssued[nPrevious] )
 	{
-		// Collided with a vehicle
-		VehicleData * pVehicleData = (VehicleData *)a->data;
-		if( pVehicleData->npc )
-			KillVehicle( pVehicleData );
-	}
-	else if( a->collision_type == T_ROCK )
-	{
-		// Collided with a rock
-		RockData * pRockData = (RockData *)a->data;
-		KillRock( pRockData );
+		return;
 	}
 
-	if( b->collision_type == T_WHEEL || b->collision_type == T_WHEEL_TRAILER )
+	for( i = 0; i < COUNT_GPU_PROFILE; ++i )
 	{
-		// Colliding wheel
-		VehicleData * pVehicleData = (VehicleData *)b->data;
-		for( i = 0; i < MAX_VEHICLE_WHEELS; ++i )
+		GLint available = 0;
+		GLuint64 elapsed;
+
+		glGetQueryObjectiv( gpuQueries[nPrevious][i], GL_QUERY_RESULT_AVAILABLE, &available );
+
+		if( available )
 		{
-			// Find this wheel in the vehicle data
-			if( pVehicleData->wheel[i].wheel == b )
-			{
-				// Kill it
-				pVehicleData->wheel[i].attached = false;
-				b->layers = LAYER_BOTTOM;
-			}
+			glGetQueryObjectui64v( gpuQueries[nPrevious][i], GL_QUERY_RESULT, &elapsed );
+			g_dProfileTime[PROFILE_GPU_SCENE + i] = double( elapsed ) * 1e-9;
 		}
 	}
 
-	UpdateScore();
-
-	return TRUE;
+	g_bGpuQueriesIssued[nPrevious] = false;
 }
+#endif
 
-void ApplyBoost( void )
+// Close the profile of a frame, log it and start the next one
+void ProfileFrame( void )
 {
-	float impulse = 1 / 1 + exp( -g_fBoost ) * WORLD_SCALE;
-	int i;
+	double time = GetTime();
+	unsigned int i;
 
-	cpVect vec = cpv( impulse * impulse * WORLD_SCALE * 3.0f, WORLD_SCALE * 2.5f );
+#ifndef HEADLESS
+	ReadGpuProfile();
+#endif
 
-	for( i = 0; i < 1; ++i )
+	g_dProfileTime[PROFILE_FRAME] = ( g_dProfileFrameStart != 0.0 ? time - g_dProfileFrameStart : 0.0 );
+	g_dProfileFrameStart = time;
+
+	if( g_pProfileLog )
 	{
-		if( !g_pVehicles[i].npc )
+		fprintf( g_pProfileLog, "%u", g_nProfileFrame );
+		for( i = 0; i < COUNT_PROFILE; ++i )
 		{
-			cpBodyApplyImpulse( g_pVehicles[i].chassis->body, vec, cpvzero );
-
-			if( g_fBoost < 1 )
-			{
-				g_pVehicles[i].chassis->body->w_limit = 0.1f;
-			}
-			else
-			{
-				g_pVehicles[i].chassis->body->w_limit = PLAYER_W_LIMIT;
-			}
+			fprintf( g_pProfileLog, ",%.4f", g_dProfileTime[i] * 1000.0 );
 		}
+		fprintf( g_pProfileLog, "\n" );
 	}
 
-	if( g_fBoost < 1 )
-	{
-		g_fBoost += 0.1f;
-	}
-	else
+	for( i = 0; i < COUNT_PROFILE; ++i )
 	{
-		g_fBoost = 0;
+		g_dProfileLast[i] = g_dProfileTime[i];
+		g_dProfileTime[i] = 0.0;
 	}
+
+	++g_nProfileFrame;
 }
 
-// Detached a wheel from a vehicle
-bool DetachWheel( VehicleData * pVehicleData, WheelData ** pWheelDetached )
+///***********************************************************///
+
+///***********************************************************///
+/// Replay
+///***********************************************************///
+
+// Replay modes
+#define REPLAY_NONE			0
+#define REPLAY_RECORD		1
+#define REPLAY_PLAY			2
+
+// Input bits, sampled once every physics tick
+#define INPUT_ACCELERATE	1
+#define INPUT_BRAKE			2
+#define INPUT_BOOST			4
+#define INPUT_SHOOT			8
+
+#define REPLAY_MAGIC		0x50524454	// "TDRP"
+#define REPLAY_VERSION		1
+#define REPLAY_MAX_RUN		255
+
+// A replay file holds this header followed by runs of equal input,
+// each run is a byte of input bits and a byte with the number of ticks
+struct ReplayHeader
 {
-	int i = 0;
-	*pWheelDetached = NULL;
+	unsigned int	nMagic;
+	unsigned int	nVersion;
+	unsigned int	nSeed;
+	unsigned int	nTicks;
+};
 
-	// Find the first existing wheel
-	while( pVehicleData->wheel[i].wheel == NULL || !pVehicleData->wheel[i].attached ) { ++i; }
-	
-	// Check if there are any wheels left
-	if( i == MAX_VEHICLE_WHEELS ) return false;
-	*pWheelDetached = &pVehicleData->wheel[i];
+unsigned int	g_nReplayMode;
+FILE*			g_pReplayFile;
+ReplayHeader	g_ReplayHeader;
+unsigned char	g_nReplayInput;		// Input bits of the current run
+unsigned int	g_nReplayRun;		// Ticks recorded in or left of the current run
 
-	// Remove the constraints
-	(*pWheelDetached)->attached = false;
-	cpSpaceRemoveConstraint( space, (*pWheelDetached)->spring );
-	cpSpaceRemoveConstraint( space, (*pWheelDetached)->joint );
+// Start recording the input of every physics tick, call before the world is initialized
+bool OpenReplayRecord( const char* szFileName )
+{
+	if( !(g_pReplayFile = fopen( szFileName, "wb" )) )
+	{
+		return false;
+	}
+
+	g_ReplayHeader.nMagic = REPLAY_MAGIC;
+	g_ReplayHeader.nVersion = REPLAY_VERSION;
+	g_ReplayHeader.nSeed = g_nWorldSeed;
+	g_ReplayHeader.nTicks = 0;
+
+	// Written again with the seed and number of ticks once the replay is closed
+	fwrite( &g_ReplayHeader, sizeof( ReplayHeader ), 1, g_pReplayFile );
+
+	g_nReplayRun = 0;
+	g_nReplayMode = REPLAY_RECORD;
 
 	return true;
 }
 
-void ShootAxle( void )
+// Start playing back a replay, call before the world is initialized
+bool OpenReplayPlay( const char* szFileName )
 {
-	int i;
-	cpVect launchVector = cpv( WORLD_SCALE * 4.0f, 0.0f );
-	bool f = false;
-
-	// Find a trailer with wheels and detach a wheel
-	for( i = (g_nVehicles - 1); i > 0; --i )
+	if( !(g_pReplayFile = fopen( szFileName, "rb" )) )
 	{
-		if( !g_pVehicles[i].npc )
-		{
-			WheelData * pWheel = NULL;
-			if( DetachWheel( &g_pVehicles[i], &pWheel ) )
-			{
-				f = true;
+		return false;
+	}
 
-				// Wheel was detached, so launch it
-				cpBodyApplyImpulse( pWheel->wheel->body, launchVector, cpvzero );
-				break;
-			}
-		}
+	if( fread( &g_ReplayHeader, sizeof( ReplayHeader ), 1, g_pReplayFile ) != 1 ||
+		g_ReplayHeader.nMagic != REPLAY_MAGIC || g_ReplayHeader.nVersion != REPLAY_VERSION )
+	{
+		fclose( g_pReplayFile );
+		g_pReplayFile = NULL;
+		return false;
 	}
 
-	if( !f )
+	// The recorded world is rebuilt from the same seed
+	g_nWorldSeed = g_ReplayHeader.nSeed;
+
+	g_nReplayRun = 0;
+	g_nReplayMode = REPLAY_PLAY;
+
+	return true;
+}
+
+void FlushReplayRun( void )
+{
+	if( g_nReplayRun > 0 )
 	{
-		bRun = false;
+		fputc( g_nReplayInput, g_pReplayFile );
+		fputc( g_nReplayRun, g_pReplayFile );
 	}
 }
 
-// Update physics space and spawn a rock at a certain time interval
-void UpdateSpace( void )
+void RecordInput( unsigned char nInput )
 {
-	static int lastRockSpawn;
-	int currentTime = GetTickCount();
+	if( g_nReplayRun == 0 || nInput != g_nReplayInput || g_nReplayRun == REPLAY_MAX_RUN )
+	{
+		FlushReplayRun();
 
-	const cpFloat physicsRate = 60.0f;
+		g_nReplayInput = nInput;
+		g_nReplayRun = 0;
+	}
 
-	int steps = 5;
-	cpFloat dt = 1.0f / physicsRate / (cpFloat) steps;
+	++g_nReplayRun;
+	++g_ReplayHeader.nTicks;
+}
 
-	for( int i = 0 ; i < steps ; ++i ){
-		cpSpaceStep( space, dt );
+// Read the input of the next tick, returns false at the end of the replay
+bool PlayInput( unsigned char & nInput )
+{
+	if( g_nReplayRun == 0 )
+	{
+		int input = fgetc( g_pReplayFile );
+		int run = fgetc( g_pReplayFile );
+
+		if( input == EOF || run == EOF || run == 0 )
+		{
+			return false;
+		}
+
+		g_nReplayInput = (unsigned char) input;
+		g_nReplayRun = run;
 	}
 
-	NpcApplyImpulse();
+	--g_nReplayRun;
+	nInput = g_nReplayInput;
 
-	if( g_fBoost > 0.0f )
+	return true;
+}
+
+void CloseReplay( void )
+{
+	if( !g_pReplayFile )
 	{
-		ApplyBoost();
+		return;
+	}
+
+	if( g_nReplayMode == REPLAY_RECORD )
+	{
+		FlushReplayRun();
+
+		// The seed can still be set after the replay was opened, take the one the world was built from
+		g_ReplayHeader.nSeed = g_nWorldSeed;
+
+		fseek( g_pReplayFile, 0, SEEK_SET );
+		fwrite( &g_ReplayHeader, sizeof( ReplayHeader ), 1, g_pReplayFile );
 	}
+
+	fclose( g_pReplayFile );
+	g_pReplayFile = NULL;
+	g_nReplayMode = REPLAY_NONE;
 }
 
 ///***********************************************************///
 
 ///***********************************************************///
-/// Draw functions
+/// Spatial hash
 ///***********************************************************///
 
-// Draw a cuboid
-GLvoid DrawCuboid( const cpVect & a, const cpVect & b, const cpVect & c, const cpVect & d, float z ) {
-	glBegin( GL_QUADS );
-		glNormal3d( 0, 0, -1 );
-		glVertex3d( a.x, a.y, -z );
-		glVertex3d( b.x, b.y, -z );
-		glVertex3d( c.x, c.y, -z );
-		glVertex3d( d.x, d.y, -z );
-
-		glNormal3d( 0, 0, 1 );
-		glVertex3d( a.x, a.y,  z );
-		glVertex3d( b.x, b.y,  z );
-		glVertex3d( c.x, c.y,  z );
-		glVertex3d( d.x, d.y,  z );
-
-		glNormal3d( 0, -1, 0 );
-		glVertex3d( b.x, b.y, -z );
-		glVertex3d( b.x, b.y,  z );
-		glVertex3d( a.x, a.y,  z );
-		glVertex3d( a.x, a.y, -z );
-
-		glNormal3d( 0, 1, 0 );
-		glVertex3d( c.x, c.y, -z );
-		glVertex3d( c.x, c.y,  z );
-		glVertex3d( d.x, d.y,  z );
-		glVertex3d( d.x, d.y, -z );
-
-		glNormal3d( -1, 0, 0 );
-		glVertex3d( b.x, b.y, -z );
-		glVertex3d( b.x, b.y,  z );
-		glVertex3d( c.x, c.y,  z );
-		glVertex3d( c.x, c.y, -z );
-
-		glNormal3d( 1, 0, 0 );
-		glVertex3d( a.x, a.y, -z );
-		glVertex3d( a.x, a.y,  z );
-		glVertex3d( d.x, d.y,  z );
-		glVertex3d( d.x, d.y, -z );
-	glEnd();
+#define HASH_CELLS_PER_SHAPE	10		// Chipmunk suggests about 10 cells per object
+#define HASH_MIN_CELLS			64
+
+struct HashMeasure
+{
+	cpFloat			fSize;			// Summed bounding box dimensions
+	unsigned int	nShapes;
+};
+
+FILE*			g_pHashLog;		// Diagnostic mode, hash occupancy of every step
+
+static void MeasureShape( void* ptr, void* data )
+{
+	cpShape* pShape = (cpShape*) ptr;
+	HashMeasure* pMeasure = (HashMeasure*) data;
+
+	cpBB bb = cpShapeCacheBB( pShape );
+
+	pMeasure->fSize += ((bb.r - bb.l) + (bb.t - bb.b)) * 0.5f;
+	++pMeasure->nShapes;
 }
 
-char vehicleData[] = {
-	2,								// #types
-	
-	5,	2,
-		-2, -2,
-		-2,  1,
-		 1,  1,
-		 2,  0,
-		 2, -2,
+// Size the cells of a spatial hash to the average bounding box of its shapes. Resizing
+// empties the cells, the shapes are inserted again right away so queries before the
+// next step still find them
+void ResizeHash( cpSpaceHash* hash )
+{
+	HashMeasure measure = { 0.0f, 0 };
+	cpSpaceHashEach( hash, MeasureShape, &measure );
 
-	4,	1,
-		-1, -1,
-		-1,  1,
-		 1,  1,
-		 1, -1
-};
+	if( measure.nShapes == 0 )
+	{
+		return;
+	}
 
-char* const GetVehicleData( unsigned int nType, unsigned int & nVertices, unsigned int & nScale )
+	unsigned int nCells = measure.nShapes * HASH_CELLS_PER_SHAPE;
+	cpSpaceHashResize( hash, measure.fSize / measure.nShapes, nCells > HASH_MIN_CELLS ? nCells : HASH_MIN_CELLS );
+	cpSpaceHashRehash( hash );
+}
+
+// Start writing the occupancy of the active hash after every step to a CSV file
+bool OpenHashLog( const char* szFileName )
 {
-	unsigned int i, j = 0;
-	char * ptr = NULL;
-	nVertices = 0;
+	if( !(g_pHashLog = fopen( szFileName, "w" )) )
+	{
+		return false;
+	}
 
-	if( nType < vehicleData[j++] )
+	fprintf( g_pHashLog, "tick,step,celldim,cells,used,entries,max_bin,pairs\n" );
+
+	return true;
+}
+
+void CloseHashLog( void )
+{
+	if( g_pHashLog )
 	{
-		for( i = 0; i <= nType; ++i )
-		{
-			const char n = vehicleData[j++];
-			nScale = vehicleData[j++];
-			nVertices = n;
-			ptr = &vehicleData[j];
-			j += n * 2;
-		}
+		fclose( g_pHashLog );
+		g_pHashLog = NULL;
 	}
-	return ptr;
 }
 
-GLvoid DrawShape( unsigned int nType, float fScale, float z )
+// Log the active hash after a step, entries counts a shape once for every cell it covers
+void LogHashOccupancy( unsigned int nTick, unsigned int nStep )
 {
-	unsigned int i, j;
-	unsigned int nVertices, nScale;
-	char * pVertices = GetVehicleData( nType, nVertices, nScale );
+	cpSpaceHash* hash = space->activeShapes;
+	unsigned int nUsed = 0, nEntries = 0, nMaxBin = 0;
 
-	// Front
-	glBegin( GL_TRIANGLE_FAN );
-		glNormal3f( 0, 0, -1 );
-		for( j = 0; j <= (nVertices + 1); ++j )
-		{
-			i = j % nVertices;
-			glVertex3f( float( pVertices[i*2] ) / float( nScale ) * fScale, float( pVertices[i*2+1] ) / float( nScale ) * fScale, -z );
-		}
-	glEnd();
-	// Back
-	glBegin( GL_TRIANGLE_FAN );
-		glNormal3f( 0, 0, 1 );
-		for( j = 0; j <= (nVertices + 1); ++j )
+	for( int i = 0; i < hash->numcells; ++i )
+	{
+		unsigned int nBin = 0;
+
+		for( cpSpaceHashBin* bin = hash->table[i]; bin; bin = bin->next )
 		{
-			i = j % nVertices;
-			glVertex3f( float( pVertices[i*2] ) / float( nScale ) * fScale, float( pVertices[i*2+1] ) / float( nScale ) * fScale, z );
+			++nBin;
 		}
-	glEnd();
-	// Sides
-	glBegin( GL_QUAD_STRIP );
-		for( j = 0; j <= (nVertices + 1); ++j )
+
+		if( nBin > 0 )
 		{
-			i = j % nVertices;
-			GLfloat x = float( pVertices[i*2] ) / float( nScale ) * fScale;
-			GLfloat y = float( pVertices[i*2+1] ) / float( nScale ) * fScale;
-			glNormal3f( x, y, 0 );	// TODO: fix normals
-			glVertex3f( x, y, -z );
-			glVertex3f( x, y, z );
+			++nUsed;
 		}
-	glEnd();
+
+		nEntries += nBin;
+		nMaxBin = nBin > nMaxBin ? nBin : nMaxBin;
+	}
+
+	fprintf( g_pHashLog, "%u,%u,%.4f,%d,%u,%u,%u,%d\n", nTick, nStep, hash->celldim, hash->numcells, nUsed, nEntries, nMaxBin, space->arbiters->num );
 }
 
-// Draw a wheel
-GLvoid DrawWheel( unsigned int n, float z ) {
-	unsigned int i;
+///***********************************************************///
 
-	const unsigned int nMax = 31;
-	if( n >= nMax ) n = nMax;
-	GLfloat x[nMax+1], y[nMax+1];
+///***********************************************************///
+/// Update physics routines
+///***********************************************************///
 
-	for( i = 0 ; i <= n; ++i ) {
-		GLfloat t = M_PI * 2 * (-0.5f + (GLfloat)(int( i ) - 1) / n);
-		x[i] = sin( t );
-		y[i] = cos( t );
-	}
+// Terrain streaming and releasing entities, see world initialization
+void UpdateTerrain( void );
+bool IsTerrainLoaded( cpFloat x );
+void ReleaseRock( cpSpace * space, Handle hRock );
+void ReleaseWheel( cpSpace * space, Handle hWheel );
+void ReleaseVehicle( cpSpace * space, Handle hVehicle );
+VehicleData* GetShapeVehicle( const cpShape * pShape );
 
-	// Front
-	glBegin( GL_TRIANGLE_FAN );
-		glNormal3f( 0, 0, -1 );
-		for( i = 0; i <= n; ++i ) glVertex3f( x[i], y[i], -z );
-	glEnd();
-	// Back
-	glBegin( GL_TRIANGLE_FAN );
-		glNormal3f( 0, 0, 1 );
-		for( i = 0; i <= n; ++i ) glVertex3f( x[i], y[i], z );
-	glEnd();
-	// Sides
-	glBegin( GL_QUAD_STRIP );
-		for( i = 0; i <= n; ++i ) {
-			glNormal3f( x[i], y[i], 0 );
-			glVertex3f( x[i], y[i], -z );
-			glVertex3f( x[i], y[i], z );
-		}
-	glEnd();
-}
+// Post step callback, for safe removal of bodies
+static void RemoveBody( cpSpace *space, cpShape *shape, void *data )
+{
+	cpBody* body = shape->body;
 
-// Draw a rock (sphere with lats and longs and displacement)
-GLvoid DrawRock( GLint nLats, GLint nLongs, GLfloat fDisplacement ) {
-	int i, j;
+	cpSpaceRemoveShape( space, shape );
+	cpSpaceRemoveBody( space, body );
 
-	for( i = 0 ; i <= nLats ; ++i ) {
-		#define IS_EDGE( x ) ((x == 0) || (x == nLats))
+	cpShapeFree( shape );
+	cpBodyFree( body );
+}
 
-		GLdouble lat0 = M_PI * (-0.5 + (GLdouble) (i - 1) / nLats);
-		GLdouble z0   = sin(lat0);
-		GLdouble zr0  =  cos(lat0);
-    
-		GLdouble lat1 = M_PI * (-0.5 + (GLdouble) i / nLats);
-		GLdouble z1   = sin(lat1);
-		GLdouble zr1  = cos(lat1);
-    
-		glBegin( GL_QUAD_STRIP );
-			for( j = 0 ; j <= nLongs ; ++j ) {
-				GLdouble lng = 2 * M_PI * (GLdouble) (j - 1) / nLongs;
-				GLdouble x   = cos(lng);
-				GLdouble y   = sin(lng);
-				
-				// Add displacement whenever point is not on edge
-				const GLdouble displacementFactor = 1.3f;
-				GLdouble d0 = (IS_EDGE( i-1 ) ? 0 : fDisplacement * (random( j << 8 | (i-1) ) % 10000 ) / 10000.0f * displacementFactor);
-				GLdouble d1 = (IS_EDGE( i ) ? 0 : fDisplacement * (random( j << 8 | (i) ) % 10000 ) / 10000.0f * displacementFactor);
-
-				GLdouble zrr0 = zr0 + d0;
-				GLdouble zrr1 = zr1 + d1;
-    
-				glNormal3d( x * zrr0, y * zrr0, z0 );
-				glVertex3d( x * zrr0, y * zrr0, z0 );
-				glNormal3d( x * zrr1, y * zrr1, z1 );
-				glVertex3d( x * zrr1, y * zrr1, z1 );
-			}
-		glEnd();
-    }
+// Remove a constraint from the space, if any, and free it
+static void RemoveConstraint( cpSpace *space, cpConstraint **ppConstraint )
+{
+	if( *ppConstraint )
+	{
+		cpSpaceRemoveConstraint( space, *ppConstraint );
+		cpConstraintFree( *ppConstraint );
+		*ppConstraint = NULL;
+	}
 }
 
-// Draw all active shaped in the physics space -> rocks and character
-void DrawActiveShapes( void * shape, void * data )
+// Post step callback, for safe addition of bodies
+static void AddBody( cpSpace *space, cpShape *shape, void *data )
 {
-	const cpShape * pShape = (cpShape *)shape;
-	const cpBody * pBody  = pShape->body;
+    cpSpaceAddBody(space, shape->body);
+        
+    cpSpaceAddShape(space, shape);
+}
 
-	switch( pShape->collision_type )
+void UpdateScore()
+{
+	unsigned int scoreTickDifference = g_nPhysicsTick - g_nLastScoreTick;
+
+	if( scoreTickDifference <= SCORE_COMBO_TICKS )
 	{
-		case T_ROCK:
-			{	// Rock object
-				cpCircleShape * pCircle = (cpCircleShape *)pShape;
-				cpVect c = cpvadd( pBody->p, cpvrotate( pCircle->c, pBody->rot ) );
+		g_fMultiplier += 0.2f;
+	}
+	else
+	{
+		g_fMultiplier = 1.0f;
+	}
 
-				glPushMatrix();
-					glBindTexture( GL_TEXTURE_2D, textures[0] );
-					glTranslatef( c.x, c.y, -0.5f - (pCircle->r / 2.0f) );
-					glRotatef( pBody->a * 180.0f / (cpFloat) M_PI, 0.0f, 0.0f, 1.0f );
-					glScalef( pCircle->r * (WORLD_SCALE * 5.5f), pCircle->r * (WORLD_SCALE * 5.5f), pCircle->r * (WORLD_SCALE * 5.5f) );
-					DrawRock( 30, 30, 0.2f );
-				glPopMatrix();
-			}
-			break;
-		case T_WHEEL_TRAILER:
-		case T_WHEEL:
-			{	// Wheel object
-				cpCircleShape * pCircle = (cpCircleShape *)pShape;
-				cpVect c = cpvadd( pBody->p, cpvrotate( pCircle->c, pBody->rot ) );
+	g_nScore += (10.0f * int( g_fMultiplier ));
 
-				const unsigned int nSegments = 7;
-				glPushMatrix();
-					glBindTexture( GL_TEXTURE_2D, textures[0] );
-					glPushMatrix();
-						glTranslatef( c.x, c.y, -0.5f - WORLD_SCALE );
-						glRotatef( pBody->a * 180.0f / (cpFloat) M_PI, 0.0f, 0.0f, 1.0f );
-						glScalef( pCircle->r, pCircle->r, pCircle->r );
-						DrawWheel( nSegments, WORLD_SCALE );
-					glPopMatrix();
-					glPushMatrix();
-						glTranslatef( c.x, c.y, -0.5f + WORLD_SCALE );
-						glRotatef( pBody->a * 180.0f / (cpFloat) M_PI, 0.0f, 0.0f, 1.0f );
-						glScalef( pCircle->r, pCircle->r, pCircle->r );
-						DrawWheel( nSegments, WORLD_SCALE );
-					glPopMatrix();
-				glPopMatrix();
+	g_nLastScoreTick = g_nPhysicsTick;
+}
 
-			}
-			break;
-		case T_CHASSIS:
-			{
-				VehicleData * pData = (VehicleData *)pShape->data;
-				cpPolyShape * pPoly = (cpPolyShape*)pShape;
-				cpVect * pVertices = pPoly->verts;
-				const cpVect p = pBody->p;
+// Sleeping groups of bodies are taken out of the space: their bodies and constraints are removed
+// and their shapes moved to the static hash, so they are not integrated, rehashed or collided with
+// the terrain or each other. Awake bodies still collide with them, which wakes them, see WakeHandler
+static void SleepShape( cpShape* shape )
+{
+	cpBody* body = shape->body;
 
-				glPushMatrix();
-					glBindTexture( GL_TEXTURE_2D, textures[0] );
-					glTranslatef( p.x, p.y, -0.5f );
-					glRotatef( pBody->a * 180.0f / (cpFloat) M_PI, 0.0f, 0.0f, 1.0f );
-					
-					if( pData->npc )
-					{
-						glRotatef( 180.0f, 0.0f, 1.0f, 0.0f );
-					}
+	cpSpaceRemoveShape( space, shape );
+	cpSpaceRemoveBody( space, body );
+	cpSpaceAddStaticShape( space, shape );
 
-					DrawShape( pData->carType, WORLD_SCALE, WORLD_SCALE );
-				glPopMatrix();
-			}
-			break;
-		default:
-			break;
-	}
+	body->v = body->v_bias = cpvzero;
+	body->w = body->w_bias = 0.0f;
 }
 
-// Draw a single cloud with position x, y
-GLvoid DrawCloud( float x, float y )
+// Collisions while asleep still push the body, that velocity is kept so it moves on right away
+static void WakeShape( cpShape* shape )
 {
-	glEnable( GL_BLEND );
-	glEnable( GL_ALPHA_TEST );
-	glAlphaFunc( GL_GREATER, 0.1f );
-
-	glBindTexture( GL_TEXTURE_2D, textures[2] );
-
-	glPushMatrix();
-		glTranslatef( x, y, -2.5f );
+	cpBody* body = shape->body;
 
-		glBegin( GL_QUADS );
-			glNormal3d( 0, 0, 1 );
-			
-			glTexCoord2f( 0.0f, 0.0f );
-			glVertex3f( 0.0f, 0.0f, 0.0f );
-			glTexCoord2f( 1.0f, 0.0f );
-			glVertex3f( 1.0f, 0.0f, 0.0f );
-			glTexCoord2f( 1.0f, 1.0f );
-			glVertex3f( 1.0f, 1.0f, 0.0f );
-			glTexCoord2f( 0.0f, 1.0f );
-			glVertex3f( 0.0f, 1.0f, 0.0f );
-		glEnd();
-	glPopMatrix();
-
-	glBindTexture( GL_TEXTURE_2D, 0 );
+	body->v_bias = cpvzero;
+	body->w_bias = 0.0f;
 
-	glDisable( GL_ALPHA_TEST );
-	glDisable( GL_BLEND );
+	cpSpaceRemoveStaticShape( space, shape );
+	cpSpaceAddBody( space, body );
+	cpSpaceAddShape( space, shape );
 }
 
-// Draw the complete world
-GLint DrawWorld( GLvoid )
+// Move a vehicle with its attached wheels and their constraints out of or back into the space,
+// call outside of a step
+static void SetVehicleSleeping( VehicleData * pVehicleData, bool bSleeping )
 {
-	glLoadIdentity();
-
-	// Default translation
-	g_fXScroll = -g_Camera.pivot->body->p.x;
-	glTranslatef( g_fXScroll, -1.0f, -4.7f );
+	if( pVehicleData->sleeping == bSleeping )
+	{
+		return;
+	}
 
-	// For every active shape in world, draw it
-	cpSpaceHashEach( space->activeShapes, &DrawActiveShapes, NULL );
+	for( int i = 0; i < MAX_VEHICLE_WHEELS; ++i )
+	{
+		WheelData * pWheelData = PoolGet( g_Wheels, pVehicleData->wheel[i] );
+		if( !pWheelData || !pWheelData->attached )
+			continue;
 
-	// Draw front of heightmap
-	glBindTexture( GL_TEXTURE_2D, textures[1] );
+		if( bSleeping )
+		{
+			cpSpaceRemoveConstraint( space, pWheelData->joint );
+			cpSpaceRemoveConstraint( space, pWheelData->spring );
+			SleepShape( pWheelData->wheel );
+		}
+		else
+		{
+			WakeShape( pWheelData->wheel );
+			cpSpaceAddConstraint( space, pWheelData->joint );
+			cpSpaceAddConstraint( space, pWheelData->spring );
+		}
+	}
 
-	glBindBuffer( GL_ARRAY_BUFFER, buffers[0] );
-	glVertexPointer( 3, GL_FLOAT, sizeof( VertexData ), BUFFER_OFFSET(0) );
-	glNormalPointer( GL_FLOAT, sizeof( VertexData ), BUFFER_OFFSET(12) );
-	glTexCoordPointer( 2, GL_FLOAT, sizeof( VertexData ), BUFFER_OFFSET(24) );
-	
-	glDrawArrays( GL_TRIANGLE_STRIP, 0, TERRAIN_SEGMENTS * 2 );
+	if( bSleeping )
+		SleepShape( pVehicleData->chassis );
+	else
+		WakeShape( pVehicleData->chassis );
 
-	// Draw top of heightmap
-	glBindBuffer( GL_ARRAY_BUFFER, buffers[1] );
-	glVertexPointer( 3, GL_FLOAT, sizeof( VertexData ), BUFFER_OFFSET(0) );
-	glNormalPointer( GL_FLOAT, sizeof( VertexData ), BUFFER_OFFSET(12) );
-	glTexCoordPointer( 2, GL_FLOAT, sizeof( VertexData ), BUFFER_OFFSET(24) );
-	
-	glDrawArrays( GL_TRIANGLE_STRIP, 0, TERRAIN_SEGMENTS * 2 );
+	pVehicleData->sleeping = bSleeping;
+	pVehicleData->wake = false;
+	pVehicleData->idleTicks = 0;
+}
 
-	glPushMatrix();
-		glTranslatef( 0.0f, 0.0f, -1.0f );
+static void SetRockSleeping( RockData * pRockData, bool bSleeping )
+{
+	if( pRockData->sleeping == bSleeping )
+	{
+		return;
+	}
 
-		glBindTexture( GL_TEXTURE_2D, textures[1] );
+	if( bSleeping )
+		SleepShape( pRockData->rock );
+	else
+		WakeShape( pRockData->rock );
 
-		glBindBuffer( GL_ARRAY_BUFFER, buffers[2] );
-		glVertexPointer( 3, GL_FLOAT, sizeof( VertexData ), BUFFER_OFFSET(0) );
-		glNormalPointer( GL_FLOAT, sizeof( VertexData ), BUFFER_OFFSET(12) );
-		glTexCoordPointer( 2, GL_FLOAT, sizeof( VertexData ), BUFFER_OFFSET(24) );
-	
-		glDrawArrays( GL_TRIANGLE_STRIP, 0, TERRAIN_SEGMENTS * 2 );
+	pRockData->sleeping = bSleeping;
+	pRockData->wake = false;
+	pRockData->idleTicks = 0;
+}
 
-		glBindBuffer( GL_ARRAY_BUFFER, buffers[3] );
-		glVertexPointer( 3, GL_FLOAT, sizeof( VertexData ), BUFFER_OFFSET(0) );
-		glNormalPointer( GL_FLOAT, sizeof( VertexData ), BUFFER_OFFSET(12) );
-		glTexCoordPointer( 2, GL_FLOAT, sizeof( VertexData ), BUFFER_OFFSET(24) );
-	
-		glDrawArrays( GL_TRIANGLE_STRIP, 0, TERRAIN_SEGMENTS * 2 );
-	glPopMatrix();
+void WakeVehicle( VehicleData * pVehicleData )
+{
+	SetVehicleSleeping( pVehicleData, false );
+}
 
-	glBindTexture( GL_TEXTURE_2D, 0 );
+void WakeRock( RockData * pRockData )
+{
+	SetRockSleeping( pRockData, false );
+}
 
-	float x, y;
+// Bring every sleeping group back into the space, so it is released or freed with the space
+void WakeAllBodies( void )
+{
+	unsigned int i;
 
-	srand( 10 );
-	for( int i = 0 ; i < TERRAIN_SEGMENTS ; i += 3 )
+	for( i = 0 ; i < g_Vehicles.nSlots; ++i )
 	{
-		x = i + ((rand() % 30 ) * 0.7f);
-		y = 3.0f - (rand() % 10) * 0.1f;
-		DrawCloud( x, y );
+		if( PoolIsLive( g_Vehicles, i ) )
+			WakeVehicle( &g_Vehicles.pData[i] );
 	}
 
-	return TRUE;
+	for( i = 0 ; i < g_Rocks.nSlots; ++i )
+	{
+		if( PoolIsLive( g_Rocks, i ) )
+			WakeRock( &g_Rocks.pData[i] );
+	}
 }
 
-// Print text to the screen
-GLvoid glPrintf( const char* szFormat, ... )
+// The space can not change during a step, so collisions only mark the sleeping group of a
+// shape and WakeQueuedBodies wakes it after the step
+void QueueWake( const cpShape * pShape )
 {
-	char	text[256];
-	va_list pArguments;
-
-	// No text, do nothing
-	if ( szFormat == NULL )
+	if( pShape->collision_type == T_ROCK )
 	{
-		return;
+		RockData * pRockData = PoolGet( g_Rocks, SHAPE_HANDLE( pShape ) );
+		if( pRockData && pRockData->sleeping )
+		{
+			pRockData->wake = true;
+			g_bWakeQueued = true;
+		}
+	}
+	else if( pShape->collision_type == T_CHASSIS || pShape->collision_type == T_WHEEL || pShape->collision_type == T_WHEEL_TRAILER )
+	{
+		VehicleData * pVehicleData = GetShapeVehicle( pShape );
+		if( pVehicleData && pVehicleData->sleeping )
+		{
+			pVehicleData->wake = true;
+			g_bWakeQueued = true;
+		}
 	}
-
-	va_start( pArguments, szFormat );
-	    wvsprintf( text, szFormat, pArguments );
-	va_end( pArguments );
-
-	glPushAttrib( GL_LIST_BIT );	
-	glListBase( fontList - 32 );
-	glCallLists( strlen( text ), GL_UNSIGNED_BYTE, text );
-	glPopAttrib();
 }
 
-// Draw the complete scene
-GLint DrawGLScene( GLvoid )
+// Default collision handler, for all pairs without a handler of their own
+static int WakeHandler( cpArbiter* pArbiter, struct cpSpace* pSpace, void* pData )
 {
-	cpBody * pPcCar;
+	CP_ARBITER_GET_SHAPES( pArbiter, a, b );
 
-	// Diffuse light position, following path
-	const GLfloat diffusePosition[]  = { 2.8f, 10.0f, 10.0f, 1.0f };
+	QueueWake( a );
+	QueueWake( b );
 
-	const GLfloat diffuseColor[] = { 0.65f, 0.65f, 0.65f, 1.0f };
+	return TRUE;
+}
 
-	// Make sure not to scroll further than left and right boundaries
-	pPcCar = g_pVehicles[0].chassis->body;
-	if( pPcCar->p.x > (g_fTerrainStep * 10) && pPcCar->p.x < (g_fTerrainStep * 191))
+// Wake the groups hit during the last step, call after every step. Pools are walked in order,
+// so bodies are added to the space in the same order on every run of a replay
+void WakeQueuedBodies( void )
+{
+	unsigned int i;
+
+	if( !g_bWakeQueued )
 	{
-		g_fXScroll = pPcCar->p.x * -1.0f;
+		return;
 	}
 
-	glEnableClientState( GL_VERTEX_ARRAY );
-	glEnableClientState( GL_TEXTURE_COORD_ARRAY );
-	glEnableClientState( GL_NORMAL_ARRAY );
-
-	glEnable( GL_DEPTH_TEST );
-
-	glEnable( GL_LIGHT0 );
-	glLightfv( GL_LIGHT0, GL_POSITION, diffusePosition );
-	glLightfv( GL_LIGHT0, GL_DIFFUSE, diffuseColor );
+	g_bWakeQueued = false;
 
-	//Render world to FBO for use with fragment shaders
-	glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, fbo );
+	for( i = 0 ; i < g_Vehicles.nSlots; ++i )
+	{
+		if( PoolIsLive( g_Vehicles, i ) && g_Vehicles.pData[i].wake )
+			WakeVehicle( &g_Vehicles.pData[i] );
+	}
 
-	//Bind gl_FragData[0] to GL_COLOR_ATTACHMENT0_EXT and gl_FragData[1] to GL_COLOR_ATTACHMENT1_EXT
-	GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT0_EXT, GL_COLOR_ATTACHMENT1_EXT };
-	glDrawBuffers( 2, drawBuffers );
+	for( i = 0 ; i < g_Rocks.nSlots; ++i )
+	{
+		if( PoolIsLive( g_Rocks, i ) && g_Rocks.pData[i].wake )
+			WakeRock( &g_Rocks.pData[i] );
+	}
+}
 
-	glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
+inline cpFloat GetBodySpeedSq( const cpBody* body )
+{
+	return cpvlengthsq( body->v ) + body->w * body->w * WORLD_SCALE * WORLD_SCALE;
+}
 
-	//Render world with textures
-	glUseProgram( programLighting );
-		glUniform1i( glGetUniformLocation( programLighting, "tex" ), 0 );
-		glEnable( GL_TEXTURE_2D );
-		DrawWorld();
-		glDisable( GL_TEXTURE_2D );
-	glUseProgram( 0 );
+// Count the ticks all bodies of an awake group were idle, returns whether they were idle
+// long enough to fall asleep
+bool IsGroupSettled( cpBody** ppBodies, unsigned int nBodies, unsigned char & nIdleTicks )
+{
+	for( unsigned int i = 0; i < nBodies; ++i )
+	{
+		if( GetBodySpeedSq( ppBodies[i] ) > SLEEP_IDLE_SPEED * SLEEP_IDLE_SPEED )
+		{
+			nIdleTicks = 0;
+			return false;
+		}
+	}
 
-	glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, 0 );
-	glDrawBuffer( GL_BACK );
-	//End of FBO rendering
+	if( nIdleTicks < SLEEP_IDLE_TICKS )
+	{
+		++nIdleTicks;
+	}
 
-	glDisable( GL_LIGHT0 );
+	return nIdleTicks >= SLEEP_IDLE_TICKS;
+}
 
-	glDisableClientState( GL_VERTEX_ARRAY );
-	glDisableClientState( GL_TEXTURE_COORD_ARRAY );
-	glDisableClientState( GL_NORMAL_ARRAY );
+// Collect the chassis and attached wheel bodies of a vehicle
+unsigned int GetVehicleBodies( VehicleData * pVehicleData, cpBody ** ppBodies )
+{
+	unsigned int n = 0;
 
-	glDisable( GL_DEPTH_TEST );
+	ppBodies[n++] = pVehicleData->chassis->body;
 
-	//Render program edges
-	glMatrixMode( GL_PROJECTION );
-	glPushMatrix();
-		glLoadIdentity();
-		gluOrtho2D( 0, 1, 0, 1 );
-		
-		glMatrixMode( GL_MODELVIEW );
-		glPushMatrix();
-			glLoadIdentity();
-			
-			// 1
-			glUseProgram( programEdge );
-			
-			glEnable( GL_TEXTURE_2D );
+	for( int i = 0; i < MAX_VEHICLE_WHEELS; ++i )
+	{
+		WheelData * pWheelData = PoolGet( g_Wheels, pVehicleData->wheel[i] );
+		if( pWheelData && pWheelData->attached )
+			ppBodies[n++] = pWheelData->wheel->body;
+	}
 
-			// 2
-			glActiveTexture( GL_TEXTURE0 ); glBindTexture( GL_TEXTURE_2D, textureColor );
-			glActiveTexture( GL_TEXTURE1 ); glBindTexture( GL_TEXTURE_2D, textureNormal );
-			glActiveTexture( GL_TEXTURE2 ); glBindTexture( GL_TEXTURE_2D, textureDepth );
-			glUniform1i( glGetUniformLocation( programEdge, "texColor" ), 0 );
-			glUniform1i( glGetUniformLocation( programEdge, "texNormal" ), 1 );
-			glUniform1i( glGetUniformLocation( programEdge, "texDepth" ), 2 );
+	return n;
+}
 
-			// 3
-			glBegin( GL_QUADS );
-				glTexCoord2f( 0.0f, 0.0f ); 
-				glVertex2f( 0.0f, 0.0f );
-				glTexCoord2f( 1.0f, 0.0f );
-				glVertex2f( 1.0f, 0.0f );
-				glTexCoord2f( 1.0f, 1.0f );
-				glVertex2f( 1.0f, 1.0f );
-				glTexCoord2f( 0.0f, 1.0f );
-				glVertex2f( 0.0f, 1.0f );
-			glEnd();
+// Let settled npc vehicles and rocks sleep, call every physics tick. Entities outside the loaded
+// terrain sleep until their chunk is loaded, or are released when they were falling out of the
+// world anyway. Sleeping groups are woken by collisions, impulses and loading terrain instead.
+void UpdateSleepingBodies( void )
+{
+	cpBody* bodies[MAX_VEHICLE_WHEELS + 1];
+	unsigned int i;
 
-			glActiveTexture( GL_TEXTURE2 ); glBindTexture( GL_TEXTURE_2D, 0 );
-			glActiveTexture( GL_TEXTURE1 ); glBindTexture( GL_TEXTURE_2D, 0 );
-			glActiveTexture( GL_TEXTURE0 ); glBindTexture( GL_TEXTURE_2D, 0 );
+	for( i = 0 ; i < g_Vehicles.nSlots; ++i )
+	{
+		if( !PoolIsLive( g_Vehicles, i ) )
+			continue;
 
-			glDisable( GL_TEXTURE_2D );
+		VehicleData & vehicle = g_Vehicles.pData[i];
+		bool bLoaded = IsTerrainLoaded( vehicle.chassis->body->p.x );
 
-			glUseProgram( 0 );
+		if( vehicle.dead )
+		{
+			if( !bLoaded )
+				ReleaseVehicle( space, PoolHandle( g_Vehicles, i ) );
+			continue;
+		}
 
-		glPopMatrix();
-		glMatrixMode( GL_PROJECTION );
-	glPopMatrix();
-	glMatrixMode( GL_MODELVIEW );
+		// Player character vehicles are linked and always awake
+		if( !vehicle.npc || vehicle.sleeping )
+			continue;
 
-	//Render score and multiplier text
-	glLoadIdentity();
-	glTranslatef( 0.0f, 0.0f, -1.0f );
+		unsigned int n = GetVehicleBodies( &vehicle, bodies );
 
-	glColor3ub( 255, 255, 255 );
+		if( !bLoaded || (g_bSleeping && IsGroupSettled( bodies, n, vehicle.idleTicks )) )
+			SetVehicleSleeping( &vehicle, true );
+	}
 
-	glRasterPos2f( -0.4f, 0.38f );
- 	glPrintf( "Score: %d", g_nScore );
+	for( i = 0 ; i < g_Rocks.nSlots; ++i )
+	{
+		if( !PoolIsLive( g_Rocks, i ) )
+			continue;
 
-	glRasterPos2f( -0.4f, 0.35f );
- 	glPrintf( "Multiplier: %dx", int( g_fMultiplier ) );
+		RockData & rock = g_Rocks.pData[i];
 
-	glRasterPos2f( -0.4f, 0.32f );
- 	glPrintf( "Level: %d", int( g_nLevel ) );
+		if( rock.sleeping )
+			continue;
 
-	UpdateSpace();
+		if( IsTerrainLoaded( rock.rock->body->p.x ) )
+		{
+			if( g_bSleeping && IsGroupSettled( &rock.rock->body, 1, rock.idleTicks ) )
+				SetRockSleeping( &rock, true );
+		}
+		else if( rock.rock->layers == LAYER_BOTTOM )
+		{
+			ReleaseRock( space, PoolHandle( g_Rocks, i ) );
+		}
+		else
+		{
+			SetRockSleeping( &rock, true );
+		}
+	}
 
-	return TRUE;
+	// Shot wheels are not caught by a bottom boundary outside the loaded terrain
+	for( i = 0 ; i < g_Wheels.nSlots; ++i )
+	{
+		if( PoolIsLive( g_Wheels, i ) && !g_Wheels.pData[i].attached && !IsTerrainLoaded( g_Wheels.pData[i].wheel->body->p.x ) )
+			ReleaseWheel( space, PoolHandle( g_Wheels, i ) );
+	}
 }
 
-///***********************************************************///
-
-///***********************************************************///
-/// Shader initialization
-///***********************************************************///
-
-//Create a shader with given type, size and store it in data pointed to
-GLint CreateShader( GLenum shaderType, GLint dataSize, const GLchar* data )
+// Apply impulse to non-player character, call every frame to let npc's move
+void NpcApplyImpulse()
 {
-	GLuint shader = glCreateShader( shaderType );
+	cpFloat cameraX = g_Camera.pivot->body->p.x;
 
-	if( shader )
+	for( unsigned int i = 0 ; i < g_Vehicles.nSlots; ++i )
 	{
-		glShaderSource( shader, 1, &data, &dataSize );
-		glCompileShader( shader );
-
-		GLint status = GL_FALSE;
-		glGetShaderiv( shader, GL_COMPILE_STATUS, &status );
-
-		if( status == GL_FALSE )
+		if( PoolIsLive( g_Vehicles, i ) && g_Vehicles.pData[i].npc && !g_Vehicles.pData[i].dead )
 		{
-			GLchar log[1024];
-			GLint logsize;
+			cpBody* pBody = g_Vehicles.pData[i].chassis->body;
 
-			glGetShaderInfoLog( shader, 1024, &logsize, log );
+			// Npc's far outside the camera window wait, and fall asleep, until the player gets near
+			if( fabs( pBody->p.x - cameraX ) > NPC_ACTIVE_DISTANCE )
+			{
+				continue;
+			}
 
-			MessageBox( NULL, "Failed to create shaders, your hardware seems to be unsupported.", "ERROR", MB_OK | MB_ICONEXCLAMATION );
-			
-#ifdef MEAN
-			return 0;
-#endif
+			WakeVehicle( &g_Vehicles.pData[i] );
+			cpBodyApplyImpulse( pBody, cpv( -WORLD_SCALE * 0.25f + fmod( pBody->a, M_PI / 2.0 ) / M_PI * 0.15f, 0.0f ), cpvzero );
 		}
 	}
-
-	return shader;
 }
 
-GLint CreateProgram( GLint vertexSize, const GLchar* vertexShader, GLint fragmentSize, const GLchar* fragmentShader )
+void HandlePcVehicle( const unsigned int handlingType )
 {
-	GLint vShader, fShader, program = 0;
+	VehicleData* pPcVehicle = PoolGet( g_Vehicles, g_hPcVehicle );
+	if( !pPcVehicle ) return;
 
-	vShader = CreateShader( GL_VERTEX_SHADER, vertexSize, vertexShader );	
-	fShader = CreateShader( GL_FRAGMENT_SHADER, fragmentSize, fragmentShader );
+	cpBody* pPcCar = pPcVehicle->chassis->body;
 
-	if( vShader && fShader )
-	{
-		program = glCreateProgram();
-		glAttachShader( program, vShader );
-		glAttachShader( program, fShader );
-		glLinkProgram( program );
+	if( handlingType == HANDLING_ACCELERATE )
+	{	// Accelerate
+		if( pPcCar->v.x < WORLD_SCALE * 25.0f )
+		{
+			cpBodyApplyImpulse( pPcCar, cpv( (WORLD_SCALE * 0.20f + pPcCar->a / M_PI * 0.15f) * (g_nPcVehicles * 1.50f), 0.0f ), cpvzero );
+		}
+	}
+	else if( handlingType == HANDLING_BRAKE )
+	{	// Brake
+		if( pPcCar->v.x > 0 )
+		{
+			cpBodyApplyImpulse( pPcCar, cpv( -WORLD_SCALE * 0.5, 0.0f ), cpvzero );
+		}
+	}
+	else if( handlingType == HANDLING_BOOST )
+	{	// Rocket boost
+		g_fBoost = 0.01f;
 	}
-
-	return program;
 }
-///***********************************************************///
 
-///***********************************************************///
-/// Texture initialization
-///***********************************************************///
+// Kills a rock
+static void KillRock( RockData * pRock )
+{
+	QueueWake( pRock->rock );
+	pRock->rock->layers = LAYER_BOTTOM;
+}
 
-// Binds the data of a given .tar file to position in data to be
-// bound to texture
-// See:  http://local.wasp.uwa.edu.au/~pbourke/dataformats/tga/
-// Note: Only reads uncompressed .tar files, data is BGRA
-bool BindTGAData( char* szFileName, int nDataPosition )
+// Kills a vehicle
+static void KillVehicle( VehicleData * pVehicleData )
 {
-	HANDLE File;
-	short int w, h;
-	DWORD r;
+	int i;
 
-	if( sizeof( int ) != 4 )
+	QueueWake( pVehicleData->chassis );
+	pVehicleData->dead = true;
+	pVehicleData->chassis->layers = LAYER_BOTTOM;
+
+	for( i = 0; i < MAX_VEHICLE_WHEELS; ++i )
 	{
-		return FALSE;
+		WheelData * pWheelData = PoolGet( g_Wheels, pVehicleData->wheel[i] );
+		if( pWheelData )
+			pWheelData->wheel->layers = LAYER_BOTTOM;
 	}
+}
 
-	if( ( File = CreateFile( szFileName, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL ) ) == INVALID_HANDLE_VALUE )
+// Vehicle a chassis or wheel shape belongs to, NULL if it was released
+VehicleData* GetShapeVehicle( const cpShape * pShape )
+{
+	if( pShape->collision_type == T_CHASSIS )
 	{
-		return false;
+		return PoolGet( g_Vehicles, SHAPE_HANDLE( pShape ) );
 	}
 
-	SetFilePointer( File, 12, 0, FILE_BEGIN );
-	ReadFile( File, &w, sizeof( w ), &r, NULL );
-	ReadFile( File, &h, sizeof( h ), &r, NULL );
-
-	SetFilePointer( File, 18, 0, FILE_BEGIN );
-	ReadFile( File, data[nDataPosition], w * h * 4, &r, NULL );
+	WheelData * pWheelData = PoolGet( g_Wheels, SHAPE_HANDLE( pShape ) );
 
-	CloseHandle( File );
-
-	return true;
+	return ( pWheelData ? PoolGet( g_Vehicles, pWheelData->vehicle ) : NULL );
 }
 
-// Creates a checkboard-like pattern and binds it to position in data
-void BindCheckImage( int nDataPosition )
+static int KillNpcHandler( cpArbiter* pArbiter, struct cpSpace* pSpace, void* pData )
 {
-   int c;
-    
-   for ( int y = 0 ; y < 256 ; ++y ) 
-   {
-      for ( int x = 0 ; x < 256 ; ++x ) 
-	  {
-         c = (( (( (x & 0x8) == 0) ^ ( (y & 0x8) == 0 )) )) * 255;
-         data[nDataPosition][y][x][2] = (GLubyte) c;
-         data[nDataPosition][y][x][1] = (GLubyte) c;
-         data[nDataPosition][y][x][0] = (GLubyte) c;
-		 data[nDataPosition][y][x][3] = (GLubyte) 255;
-      }
-   }
-}
+	CP_ARBITER_GET_SHAPES( pArbiter, a, b );
 
-// Creates a grass-like pattern and binds it to position in data
-void BindGrassImage( int nValue, int nDataPosition )
-{
-	for ( int x = 0; x < 256 ; ++x )
+	if( a->collision_type == T_WHEEL || a->collision_type == T_CHASSIS )
 	{
-		for ( int y = 0; y < 256 ; ++y )
-		{
-			GLubyte color = (GLubyte) (128.0 + (40.0 * rand()) / RAND_MAX);
-
-			data[nDataPosition][y][x][2] = 0;
-			data[nDataPosition][y][x][1] = color * ( float( nValue ) / 100.0f);
-			data[nDataPosition][y][x][0] = 0;
-			data[nDataPosition][y][x][3] = 255;
-		}
+		// Collided with a vehicle
+		VehicleData * pVehicleData = GetShapeVehicle( a );
+		if( pVehicleData && pVehicleData->npc )
+			KillVehicle( pVehicleData );
 	}
-}
-
-// Load all textures
-GLint LoadGLTextures( GLvoid )
-{
-	BindCheckImage( 0 );
-	BindGrassImage( 93, 1 );
-	BindTGAData( "cloud.tga", 2 );
-
-	if ( data != NULL )
+	else if( a->collision_type == T_ROCK )
 	{
-		int nCountTextures = sizeof( data ) / sizeof( *data );
-
-		glPixelStorei( GL_UNPACK_ALIGNMENT, 1 );
-
-		glGenTextures( nCountTextures, textures );
-
-		//Check texture
-		glBindTexture( GL_TEXTURE_2D, textures[0] );
-		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
-		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST );
-		gluBuild2DMipmaps( GL_TEXTURE_2D, GL_RGBA, 256, 256, GL_BGRA, GL_UNSIGNED_BYTE, data[0] );
-
-		//Green noise (mountain)
-		glBindTexture( GL_TEXTURE_2D, textures[1] );
-		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
-		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST );
-		gluBuild2DMipmaps( GL_TEXTURE_2D, GL_RGBA, 256, 256, GL_BGRA, GL_UNSIGNED_BYTE, data[1] );
-
-		//Cloud
-		glBindTexture( GL_TEXTURE_2D, textures[2] );
-		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
-		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST );
-		gluBuild2DMipmaps( GL_TEXTURE_2D, GL_RGBA, 256, 256, GL_BGRA, GL_UNSIGNED_BYTE, data[2] );
+		// Collided with a rock
+		RockData * pRockData = PoolGet( g_Rocks, SHAPE_HANDLE( a ) );
+		if( pRockData )
+			KillRock( pRockData );
+	}
 
-		return TRUE;
+	if( b->collision_type == T_WHEEL || b->collision_type == T_WHEEL_TRAILER )
+	{
+		// Colliding wheel, kill it
+		WheelData * pWheelData = PoolGet( g_Wheels, SHAPE_HANDLE( b ) );
+		if( pWheelData )
+		{
+			pWheelData->attached = false;
+			b->layers = LAYER_BOTTOM;
+		}
 	}
 
-	return FALSE;
+	UpdateScore();
+
+	return TRUE;
 }
 
-///***********************************************************///
+void ApplyBoost( void )
+{
+	float impulse = 1 / 1 + exp( -g_fBoost ) * WORLD_SCALE;
+	VehicleData* pPcVehicle = PoolGet( g_Vehicles, g_hPcVehicle );
 
-///***********************************************************///
-/// OpenGL initialization
-///***********************************************************///
+	cpVect vec = cpv( impulse * impulse * WORLD_SCALE * 3.0f, WORLD_SCALE * 2.5f );
 
-// Initialize OpenGL extensions
-GLint InitExtensions( GLvoid )
-{
-	GLenum err = glewInit();
+	if( pPcVehicle )
+	{
+		cpBodyApplyImpulse( pPcVehicle->chassis->body, vec, cpvzero );
 
-	if( err != GLEW_OK )
-		return FALSE;
+		if( g_fBoost < 1 )
+		{
+			pPcVehicle->chassis->body->w_limit = 0.1f;
+		}
+		else
+		{
+			pPcVehicle->chassis->body->w_limit = PLAYER_W_LIMIT;
+		}
+	}
 
-	GLchar* extensions = (GLchar*) glGetString( GL_EXTENSIONS );
-  
-	if ( strstr( extensions, "WGL_EXT_swap_control" ) )
+	if( g_fBoost < 1 )
 	{
-		wglSwapIntervalEXT    = (PFNWGLEXTSWAPCONTROLPROC) wglGetProcAddress( "wglSwapIntervalEXT" );
-		wglGetSwapIntervalEXT = (PFNWGLEXTGETSWAPINTERVALPROC) wglGetProcAddress( "wglGetSwapIntervalEXT" );
+		g_fBoost += 0.1f;
 	}
 	else
 	{
-		MessageBox( NULL, "Failed to initialize vsync, please enable vsync in your driver settings.", "ERROR", MB_OK | MB_ICONEXCLAMATION );
+		g_fBoost = 0;
 	}
-
-	// Check for FBO and depth texture support
-	if( !glewIsSupported( "GL_EXT_framebuffer_object GL_ARB_depth_texture" ) )
-		return FALSE;
-
-   return TRUE;
 }
 
-// Initialize buffers for screen with dimensions given
-GLint InitBuffers( GLsizei nScreenWidth, GLsizei nScreenHeight )
+// Detached a wheel from a vehicle
+bool DetachWheel( VehicleData * pVehicleData, WheelData ** pWheelDetached )
 {
-	glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, fbo );
-
-	glBindTexture( GL_TEXTURE_2D, textureDepth );
-	glTexParameteri( GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,GL_LINEAR );
-	glTexParameteri( GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,GL_LINEAR );
-	glTexImage2D( GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, nScreenWidth, nScreenHeight, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_BYTE, NULL );
+	int i;
+	*pWheelDetached = NULL;
 
-	glFramebufferTexture2DEXT( GL_FRAMEBUFFER_EXT, GL_DEPTH_ATTACHMENT_EXT, GL_TEXTURE_2D, textureDepth, 0 );
+	// Find the first attached wheel
+	for( i = 0; i < MAX_VEHICLE_WHEELS && *pWheelDetached == NULL; ++i )
+	{
+		WheelData * pWheelData = PoolGet( g_Wheels, pVehicleData->wheel[i] );
+		if( pWheelData && pWheelData->attached )
+			*pWheelDetached = pWheelData;
+	}
 
-	glBindTexture( GL_TEXTURE_2D, textureColor );
-	glTexParameteri( GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,GL_LINEAR );
-	glTexParameteri( GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,GL_LINEAR );
-	glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA8, nScreenWidth, nScreenHeight, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL );
+	// Check if there are any wheels left
+	if( *pWheelDetached == NULL ) return false;
 
-	glFramebufferTexture2DEXT( GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_TEXTURE_2D, textureColor, 0 );
+	// Remove the constraints
+	(*pWheelDetached)->attached = false;
+	RemoveConstraint( space, &(*pWheelDetached)->spring );
+	RemoveConstraint( space, &(*pWheelDetached)->joint );
 
-	glBindTexture( GL_TEXTURE_2D, textureNormal );
-	glTexParameteri( GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,GL_LINEAR );
-	glTexParameteri( GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,GL_LINEAR );
-	glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA, nScreenWidth, nScreenHeight, 0, GL_RGBA, GL_FLOAT, NULL );
+	return true;
+}
 
-	glFramebufferTexture2DEXT( GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT1_EXT, GL_TEXTURE_2D, textureNormal, 0 );
+void ShootAxle( void )
+{
+	unsigned int i;
+	cpVect launchVector = cpv( WORLD_SCALE * 4.0f, 0.0f );
+	bool f = false;
 
-	GLenum status = glCheckFramebufferStatusEXT( GL_FRAMEBUFFER_EXT );
+	// Find a trailer with wheels, starting at the last one, and detach a wheel
+	for( i = g_Vehicles.nSlots; i-- > 0; )
+	{
+		if( PoolIsLive( g_Vehicles, i ) && !g_Vehicles.pData[i].npc && PoolHandle( g_Vehicles, i ) != g_hPcVehicle )
+		{
+			WheelData * pWheel = NULL;
+			if( DetachWheel( &g_Vehicles.pData[i], &pWheel ) )
+			{
+				f = true;
 
-	if( status != GL_FRAMEBUFFER_COMPLETE_EXT ) {
-		return FALSE;
+				// Wheel was detached, so launch it
+				cpBodyApplyImpulse( pWheel->wheel->body, launchVector, cpvzero );
+				break;
+			}
+		}
 	}
 
-	glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, 0 );
-
-	return TRUE;
+	if( !f )
+	{
+		bRun = false;
+	}
 }
 
-// Create font and store for use in glPrintf
-GLvoid CreateFont( GLvoid )
+// Sample the keys held into input bits
+unsigned char SampleInput( void )
 {
-	HFONT	font;
-	HFONT	oldfont;
-
-	fontList = glGenLists( 96 );
+	unsigned char nInput = 0;
 
-	font = CreateFont( -12,
-						0,
-						0,
-						0,
-						FW_BOLD,
-						FALSE,
-						FALSE,
-						FALSE,
-						ANSI_CHARSET,
-						OUT_TT_PRECIS,
-						CLIP_DEFAULT_PRECIS,
-						ANTIALIASED_QUALITY,
-						FF_DONTCARE|DEFAULT_PITCH,
-						"Verdana" );
+	if( g_bKeys[VK_RIGHT] )	nInput |= INPUT_ACCELERATE;
+	if( g_bKeys[VK_LEFT] )	nInput |= INPUT_BRAKE;
+	if( g_bKeys[VK_SHIFT] )	nInput |= INPUT_BOOST;
+	if( g_bKeys[VK_SPACE] )	nInput |= INPUT_SHOOT;
 
-	oldfont = (HFONT) SelectObject( hDC, font );
-	wglUseFontBitmaps( hDC, 32, 96, fontList );
-	SelectObject( hDC, oldfont );
-	DeleteObject( font );
+	return nInput;
 }
 
-// Delete the stored font
-GLvoid DeleteFont( GLvoid )
+// Handle the player character input, call every physics tick
+void HandleInput( unsigned char nInput )
 {
-	glDeleteLists( fontList, 96 );
-}
+	if( nInput & INPUT_BOOST )
+	{
+		HandlePcVehicle( HANDLING_BOOST );
+	}
 
-// Initialize OpenGL
-GLint InitGL( GLvoid )
-{
-	if( !LoadGLTextures() )
+	if( !(nInput & INPUT_SHOOT) && g_bKeyLock )
 	{
-		return FALSE;
+		ShootAxle();
+		g_bKeyLock = FALSE;
 	}
 
-	if( !InitExtensions() )
+	if( nInput & INPUT_SHOOT )
 	{
-		return FALSE;
+		g_bKeyLock = TRUE;
 	}
 
-	// Lighting shaders
-	if( !(programLighting = CreateProgram( sizeof(vertexShaderDefault), vertexShaderDefault, sizeof(fragmentShaderScene), fragmentShaderScene )) )
+	if( nInput & INPUT_BRAKE )
 	{
-#ifdef MEAN
-		return FALSE;
-#endif
+		HandlePcVehicle( HANDLING_BRAKE );
 	}
 
-	// Edge shaders
-	if( !(programEdge = CreateProgram( sizeof(vertexShaderDefault), vertexShaderDefault, sizeof(fragmentShaderEdge), fragmentShaderEdge )) )
+	if( nInput & INPUT_ACCELERATE )
 	{
-#ifdef MEAN
-		return FALSE;
-#endif
+		HandlePcVehicle( HANDLING_ACCELERATE );
 	}
+}
 
-	glGenFramebuffersEXT( 1, &fbo );
-	glGenTextures( 1, &textureDepth );
-	glGenTextures( 1, &textureColor );
-	glGenTextures( 1, &textureNormal );
-	
-	glShadeModel( GL_SMOOTH );
-	glClearColor( 0.06f, 0.7f, 0.9f, 1 );
-	glClearDepth( 1.0f );
-	glDepthFunc( GL_LESS );
-	glHint( GL_PERSPECTIVE_CORRECTION_HINT, GL_NICEST );
-	glHint( GL_LINE_SMOOTH_HINT, GL_NICEST );
+// Handle the input of this physics tick, played back from or recorded to a replay
+void HandleKeys( void )
+{
+	unsigned char nInput;
 
-	glBlendFunc( GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA );
-	glDisable( GL_COLOR_MATERIAL );
+	if( g_nReplayMode == REPLAY_PLAY )
+	{
+		// Hand control back to the keys once the replay ends
+		if( !PlayInput( nInput ) )
+		{
+			CloseReplay();
+			nInput = SampleInput();
+		}
+	}
+	else
+	{
+		nInput = SampleInput();
 
-	CreateFont();
+		if( g_nReplayMode == REPLAY_RECORD )
+		{
+			RecordInput( nInput );
+		}
+	}
 
-	return TRUE;
+	HandleInput( nInput );
 }
 
-///***********************************************************///
+// Update physics space by a single fixed physics tick
+void UpdateSpace( void )
+{
+	int steps = PHYSICS_SUBSTEPS;
+	cpFloat dt = 1.0f / PHYSICS_RATE / (cpFloat) steps;
 
-///***********************************************************///
-/// World initialization
-///***********************************************************///
+	for( int i = 0 ; i < steps ; ++i ){
+		ProfileBegin( PROFILE_STEP + i );
+		cpSpaceStep( space, dt );
+		WakeQueuedBodies();
+		ProfileEnd( PROFILE_STEP + i );
 
-void CameraPositionSync( cpBody* body, cpFloat dt )
-{
-	// Sync to player character
-	if( g_pVehicles[0].chassis )
-		body->p = g_pVehicles[0].chassis->body->p;
-}
+		if( g_pHashLog )
+		{
+			LogHashOccupancy( g_nPhysicsTick, i );
+		}
+	}
 
-void ResetArrays( void )
-{
-	g_nVehicles = 0;
-	g_nRocks = 0;
-	ZeroMemory( g_pVehicles, sizeof( VehicleData ) * MAX_VEHICLES );
-	ZeroMemory( g_pRocks, sizeof( RockData ) * MAX_ROCKS );
-}
+	ProfileBegin( PROFILE_NPC );
+	NpcApplyImpulse();
+	ProfileEnd( PROFILE_NPC );
 
-void AllocArrays( void )
-{
-	g_pVehicles = new VehicleData[MAX_VEHICLES];
-	g_pRocks = new RockData[MAX_ROCKS];
+	if( g_fBoost > 0.0f )
+	{
+		ApplyBoost();
+	}
 
-	ResetArrays();
-}
+	UpdateTerrain();
 
-void FreeArrays( void )
-{
-	delete [] g_pVehicles;
-	delete [] g_pRocks;
+	UpdateSleepingBodies();
+
+	++g_nPhysicsTick;
 }
 
-cpShape* SpawnVehicle( const int x, unsigned char nCarType = 0, int nWheelPairs = 2, bool bNpc = true )
+// Remember the position and angle of every body before a physics tick
+void SaveBodyStates( void )
 {
-	cpBody*			body;
-	cpShape*		shape;
-	cpShape*		chassis;
+	cpArray* pBodies = space->bodies;
+	int i;
 
-	cpBody*			wheel;
-	cpConstraint*	joint;
-	cpConstraint*	spring;
+	if( g_nMaxBodyStates < (unsigned int) pBodies->num )
+	{
+		delete[] g_pBodyStates;
 
-	VehicleData*	pVehicleData;
-	WheelData*		pWheelData;
+		g_nMaxBodyStates = pBodies->num * 2;
+		g_pBodyStates = new BodyState[g_nMaxBodyStates];
+	}
 
-	// Make sure that wheel pairs is below the maximum for a vehicle
-	if( nWheelPairs > MAX_VEHICLE_WHEELS ) nWheelPairs = MAX_VEHICLE_WHEELS;
+	for( i = 0; i < pBodies->num; ++i )
+	{
+		cpBody * pBody = (cpBody *)pBodies->arr[i];
 
-	// Get a unique group ID for this vehicle
-	int group = ( bNpc ? GROUP_NPC + g_nNpcVehicles : GROUP_PC );
+		g_pBodyStates[i].body = pBody;
+		g_pBodyStates[i].p = pBody->p;
+		g_pBodyStates[i].a = pBody->a;
+	}
 
-	cpFloat wheelMass = WORLD_SCALE;
-	cpVect offset;
+	g_nBodyStates = pBodies->num;
+}
 
-	cpVect verts[] = {
-		cpv(  WORLD_SCALE, -WORLD_SCALE ),
-		cpv( -WORLD_SCALE, -WORLD_SCALE ),
-		cpv( -WORLD_SCALE,  WORLD_SCALE * 0.5f ),
-		cpv(  WORLD_SCALE,  WORLD_SCALE * 0.5f )
-	};
+// Move all bodies in between their state before and after the last physics tick,
+// call before rendering and call RestoreBodyStates afterwards
+void InterpolateBodyStates( cpFloat alpha )
+{
+	cpArray* pBodies = space->bodies;
+	unsigned int i;
 
-	const cpFloat fWheelRadius = WORLD_SCALE * 0.4f;
+	for( i = 0; i < g_nBodyStates && i < (unsigned int) pBodies->num; ++i )
+	{
+		BodyState & state = g_pBodyStates[i];
 
-	body    = cpBodyNew( WORLD_SCALE * 12.0f, cpMomentForPoly( WORLD_SCALE * 5.0f, sizeof( verts ) / sizeof( cpVect ), verts, cpvzero ) );
-	body->p = cpv( x * g_fTerrainStep, g_pRoadHeightMap[x].y + WORLD_SCALE * 3.0f );
-	body->w_limit = PLAYER_W_LIMIT;
+		// Bodies added or removed during the last tick are not interpolated
+		if( state.body != pBodies->arr[i] )
+		{
+			continue;
+		}
 
-	cpBodyApplyForce( body, cpv( 0.0f, WORLD_SCALE * 21.0f ), cpvzero );
+		state.pTick = state.body->p;
+		state.aTick = state.body->a;
 
-	if( bNpc )
-	{
-		// Non-player character vehicle
-		++g_nNpcVehicles;
+		state.body->p = cpvlerp( state.p, state.pTick, alpha );
+		cpBodySetAngle( state.body, state.a + (state.aTick - state.a) * alpha );
 	}
-	else
+}
+
+// Move all bodies back to their physics state
+void RestoreBodyStates( void )
+{
+	cpArray* pBodies = space->bodies;
+	unsigned int i;
+
+	for( i = 0; i < g_nBodyStates && i < (unsigned int) pBodies->num; ++i )
 	{
-		// Player character vehicle
-		++g_nPcVehicles;
+		BodyState & state = g_pBodyStates[i];
+
+		if( state.body != pBodies->arr[i] )
+		{
+			continue;
+		}
+
+		state.body->p = state.pTick;
+		cpBodySetAngle( state.body, state.aTick );
 	}
-	pVehicleData = &g_pVehicles[g_nVehicles++];
+}
 
-	chassis = cpPolyShapeNew( body, sizeof( verts ) / sizeof( cpVect ), verts, cpvzero );
-	chassis->e = 0.0f; chassis->u = WORLD_SCALE * 0.5f;
-	chassis->group = group;
-	chassis->collision_type = T_CHASSIS;
-	chassis->data = pVehicleData;
-	chassis->layers = LAYER_DEFAULT;
-	AddBody( space, chassis, NULL );
+// Run as many fixed physics ticks as fit in the time passed since the previous call
+void AdvanceSpace( void )
+{
+	const double tick = 1.0 / PHYSICS_RATE;
+	double time = GetTime();
+	double frameTime = time - g_dPhysicsTime;
 
-	// Camera constraints
-	cpSpaceAddConstraint( space, cpSlideJointNew( g_Camera.pivot->body, g_Camera.player->body, cpvzero, cpvzero, CAMERA_FOLLOW_MIN, CAMERA_FOLLOW_MAX ) );
-	
-	pVehicleData->carType = nCarType;
-	pVehicleData->npc = bNpc;
-	pVehicleData->chassis = chassis;
+	if( g_dPhysicsTime == 0.0 )
+	{
+		frameTime = tick;
+	}
 
-	for( int i = 0 ; i < nWheelPairs ; ++i ) 
+	g_dPhysicsTime = time;
+
+	// Drop time that can not be caught up with, rather than falling behind further
+	if( frameTime > tick * PHYSICS_MAX_TICKS )
 	{
-		offset = cpv( -WORLD_SCALE + (WORLD_SCALE * ( nCarType == 0 && !bNpc ? 3 : 2 ) / float( nWheelPairs - 1 )) * i, -WORLD_SCALE * 1.2f );
+		frameTime = tick * PHYSICS_MAX_TICKS;
+	}
 
-		wheel = cpBodyNew( wheelMass, cpMomentForCircle( wheelMass, 0.0, fWheelRadius, cpvzero ) );
-		wheel->p = cpvadd( body->p, offset );
-		wheel->v = body->v;
+	g_dPhysicsAccumulator += frameTime;
 
-		shape = cpCircleShapeNew( wheel, fWheelRadius, cpvzero );
-		shape->e = 0.0;
-		shape->u = 2.5;
-		
-		if( nCarType == 0 )
-		{
-			shape->collision_type = T_WHEEL;
-		}
-		else
-		{
-			shape->collision_type = T_WHEEL_TRAILER;
-		}
-		
-		shape->group = group;
-		shape->data = pVehicleData;
-		shape->layers = LAYER_DEFAULT;
-		AddBody( space, shape, NULL );
+	while( g_dPhysicsAccumulator >= tick )
+	{
+		SaveBodyStates();
 
-		// Create a joint that holds the wheel
-		joint = cpPinJointNew( body, wheel, cpvzero, cpvzero );
-		cpSpaceAddConstraint( space, joint );
+		UpdateSpace();
 
-		// Create a spring for wheel suspension
-		spring = cpDampedSpringNew( body, wheel, cpv( offset.x, offset.y ), cpvzero, 0.0f, 300.0f, WORLD_SCALE );
-		cpSpaceAddConstraint( space, spring );
+		HandleKeys();
 
-		pWheelData = &pVehicleData->wheel[i];
-		pWheelData->attached = true;
-		pWheelData->joint = joint;
-		pWheelData->spring = spring;
-		pWheelData->wheel = shape;
+		g_dPhysicsAccumulator -= tick;
 	}
 
-	cpBodySetAngle( body, -g_pRoadHeightMap[x].a );
-
-	return chassis;
+	g_fPhysicsAlpha = g_dPhysicsAccumulator / tick;
 }
 
-// Creates a new rock and adds it to the physics space
-void SpawnRock()
-{
-	cpBody*  body;
-	cpShape* shape;
+///***********************************************************///
 
-	RockData* pRockData;
+#ifndef HEADLESS
+///***********************************************************///
+/// Draw functions
+///***********************************************************///
 
-	const cpFloat radius = 0.1f + float( rand() % 20 ) / 25.0f * 0.4f;
-	const cpFloat mass   = radius * WORLD_SCALE * 75.0f;
+char vehicleData[] = {
+	2,								// #types
+	
+	5,	2,
+		-2, -2,
+		-2,  1,
+		 1,  1,
+		 2,  0,
+		 2, -2,
 
-	int x = rand() % TERRAIN_SEGMENTS;
+	4,	1,
+		-1, -1,
+		-1,  1,
+		 1,  1,
+		 1, -1
+};
 
-	body       = cpBodyNew( mass, cpMomentForCircle( mass, 0.0f, radius, cpvzero ) );
-	body->p    = cpv( x * g_fTerrainStep, g_pRoadHeightMap[x].y + WORLD_SCALE * 3.0f + radius );
+#define MAX_SHAPE_VERTICES	16	// Array boundary for a single vehicle type
 
-	pRockData = &g_pRocks[g_nRocks++];
-	shape    = cpCircleShapeNew( body, radius, cpvzero );
-	shape->e = 0.05f; shape->u = 0.1f;
-	shape->data = pRockData;
-	shape->collision_type = T_ROCK;
-	shape->layers = LAYER_DEFAULT;
-	AddBody( space, shape, NULL );
+char* const GetVehicleData( unsigned int nType, unsigned int & nVertices, unsigned int & nScale )
+{
+	unsigned int i, j = 0;
+	char * ptr = NULL;
+	nVertices = 0;
 
-	pRockData->rock = shape;
+	if( nType < vehicleData[j++] )
+	{
+		for( i = 0; i <= nType; ++i )
+		{
+			const char n = vehicleData[j++];
+			nScale = vehicleData[j++];
+			nVertices = n;
+			ptr = &vehicleData[j];
+			j += n * 2;
+		}
+	}
+	return ptr;
 }
 
-void StartLevel()
-{
-	cpConstraint* constraint;
-	cpShape* shape;
+// Build a rock mesh (sphere with lats and longs and displacement)
+GLvoid BuildRockMesh( MeshData & mesh, GLint nLats, GLint nLongs, GLfloat fDisplacement ) {
+	int i, j, k;
 
-	cpBody* body;
-	cpBody* bodyLast;
+	// Rings -1 up to and including nLats, each with nLongs + 1 vertices
+	const int nRing = nLongs + 1;
+	const int nVertices = (nLats + 2) * nRing;
+	VertexData* pVertices = new VertexData[nVertices];
+	GLushort* pIndices = new GLushort[(nLats + 1) * nLongs * 6];
 
-	int f = 0 + 10;
+	#define IS_EDGE( x ) ((x == 0) || (x == nLats))
 
-	ResetArrays();
+	for( k = -1 ; k <= nLats ; ++k ) {
+		GLdouble lat = M_PI * (-0.5 + (GLdouble) k / nLats);
+		GLdouble z   = sin(lat);
+		GLdouble zr  = cos(lat);
 
-	// Spawn player character vehicle (car)
-	shape = SpawnVehicle( f + 2, 0, COUNT_WHEELS_CAR, false );
-	g_pVehicles[0].chassis = shape;
-	body = bodyLast = shape->body;
-	
-	// Spawn player character vehicles (trailers)
-	for( int i = 0; i < g_nLevel; ++i )
-	{
-		shape = SpawnVehicle( f - i * 2, 1, COUNT_WHEELS_TRAILER, false );
-		body = shape->body;
+		for( j = 0 ; j <= nLongs ; ++j ) {
+			GLdouble lng = 2 * M_PI * (GLdouble) (j - 1) / nLongs;
+			GLdouble x   = cos(lng);
+			GLdouble y   = sin(lng);
 
-		constraint = cpDampedSpringNew( body, bodyLast, cpvzero, cpvzero, bodyLast->p.x - body->p.x, 600.0f, 1.0f );
-		g_pVehicles[g_nVehicles - 1].link = constraint;
+			// Add displacement whenever point is not on edge
+			const GLdouble displacementFactor = 1.3f;
+			GLdouble d = (IS_EDGE( k ) ? 0 : fDisplacement * (random( j << 8 | k ) % 10000 ) / 10000.0f * displacementFactor);
 
-		cpSpaceAddConstraint( space, constraint );
-		cpSpaceAddConstraint( space, cpRotaryLimitJointNew( body, bodyLast, -5.0f * (M_PI / 180), 5.0f * (M_PI / 180) ) );
-		cpSpaceAddConstraint( space, cpGrooveJointNew( bodyLast, body, cpv( -WORLD_SCALE * 10, 0 ), cpvzero, cpvzero ) );
+			GLdouble zrr = zr + d;
 
-		bodyLast = body;
+			VertexData & v = pVertices[(k + 1) * nRing + j];
+			v.x = v.nx = x * zrr;
+			v.y = v.ny = y * zrr;
+			v.z = v.nz = z;
+
+			// Constant texture coordinate, the texture is not mapped onto rocks
+			v.s = 0.0f;
+			v.t = 1.0f;
+		}
 	}
 
-	float c = (TERRAIN_SEGMENTS - 2 * f) / (g_nLevel * 2);
+	#undef IS_EDGE
 
-	// Spawn non-player character vehicles
-	for( int i = 0; i < (g_nLevel * 2); ++i )
-	{
-		f += c;
-		SpawnVehicle( f, 0 );
-	}
+	// A band of quads between every two consecutive rings
+	mesh.nIndices = 0;
+	for( i = 0 ; i <= nLats ; ++i ) {
+		for( j = 0 ; j < nLongs ; ++j ) {
+			GLushort a = i * nRing + j;
+			GLushort b = (i + 1) * nRing + j;
 
-	// Spawn rocks
-	srand( GetTickCount() );
-	for( int i = 0 ; i < (g_nLevel * 3) ; ++i )
-	{
-		SpawnRock();
+			pIndices[mesh.nIndices++] = a;
+			pIndices[mesh.nIndices++] = b;
+			pIndices[mesh.nIndices++] = a + 1;
+
+			pIndices[mesh.nIndices++] = a + 1;
+			pIndices[mesh.nIndices++] = b;
+			pIndices[mesh.nIndices++] = b + 1;
+		}
 	}
+
+	glGenBuffers( 1, &mesh.vertexBuffer );
+	glBindBuffer( GL_ARRAY_BUFFER, mesh.vertexBuffer );
+	glBufferData( GL_ARRAY_BUFFER, nVertices * sizeof( VertexData ), pVertices, GL_STATIC_DRAW );
+	glBindBuffer( GL_ARRAY_BUFFER, 0 );
+
+	glGenBuffers( 1, &mesh.indexBuffer );
+	glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, mesh.indexBuffer );
+	glBufferData( GL_ELEMENT_ARRAY_BUFFER, mesh.nIndices * sizeof( GLushort ), pIndices, GL_STATIC_DRAW );
+	glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, 0 );
+
+	delete[] pVertices;
+	delete[] pIndices;
 }
 
-static void NewSpace( cpSpace *space, cpShape *shape, void *data )
+// Set position and normal of a mesh vertex
+inline GLvoid SetMeshVertex( VertexData & v, GLfloat x, GLfloat y, GLfloat z, GLfloat nx, GLfloat ny, GLfloat nz )
 {
-	int i, j;
-	WheelData * pWheelData;
+	v.x = x;
+	v.y = y;
+	v.z = z;
+	v.nx = nx;
+	v.ny = ny;
+	v.nz = nz;
+
+	// Constant texture coordinate, the texture is not mapped onto meshes
+	v.s = 0.0f;
+	v.t = 1.0f;
+}
 
-	// Removes the rocks
-	for( i = 0 ; i < g_nRocks ; ++i )
+// Build a prism mesh from a convex polygon with n vertices, extruded from -z to z
+// Round shapes get smooth side normals, other shapes one normal per side face
+GLvoid BuildPrismMesh( MeshData & mesh, const GLfloat * pX, const GLfloat * pY, unsigned int n, GLfloat z, bool bRound )
+{
+	unsigned int i, j;
+	GLfloat cx = 0.0f, cy = 0.0f;
+
+	VertexData* pVertices = new VertexData[n * 6];
+	GLushort* pIndices = new GLushort[(n - 2) * 6 + n * 6];
+
+	mesh.nIndices = 0;
+
+	// Front and back
+	for( i = 0; i < n; ++i )
 	{
-		RemoveBody( space, g_pRocks[i].rock, NULL );
+		SetMeshVertex( pVertices[i * 2],     pX[i], pY[i], -z, 0.0f, 0.0f, -1.0f );
+		SetMeshVertex( pVertices[i * 2 + 1], pX[i], pY[i],  z, 0.0f, 0.0f,  1.0f );
+
+		cx += pX[i] / n;
+		cy += pY[i] / n;
 	}
 
-	// Removes the vehicles
-	for( i = 0 ; i < g_nVehicles ; ++i )
+	for( i = 1; i < n - 1; ++i )
 	{
-		RemoveBody( space, g_pVehicles[i].chassis, NULL );
-		for( j = 0 ; j < MAX_VEHICLE_WHEELS ; ++j )
+		for( j = 0; j < 2; ++j )
 		{
-			pWheelData = &g_pVehicles[i].wheel[j];
-			if( pWheelData->wheel != NULL )
-			{
-				// Existing wheel, remove it
-				RemoveBody( space, pWheelData->wheel, NULL );
-			}
+			pIndices[mesh.nIndices++] = j;
+			pIndices[mesh.nIndices++] = i * 2 + j;
+			pIndices[mesh.nIndices++] = (i + 1) * 2 + j;
 		}
 	}
 
-	++g_nLevel;
-
-	StartLevel();
-}
+	// Sides, four vertices per face
+	for( i = 0; i < n; ++i )
+	{
+		unsigned int a = i;
+		unsigned int b = (i + 1) % n;
+		VertexData * v = &pVertices[n * 2 + i * 4];
 
-static int NewLevel( cpArbiter* pArbiter, struct cpSpace* pSpace, void* pData )
-{    
-	cpSpaceAddPostStepCallback( space, (cpPostStepFunc) NewSpace, NULL, NULL );
+		if( bRound )
+		{
+			SetMeshVertex( v[0], pX[a], pY[a], -z, pX[a], pY[a], 0.0f );
+			SetMeshVertex( v[1], pX[a], pY[a],  z, pX[a], pY[a], 0.0f );
+			SetMeshVertex( v[2], pX[b], pY[b], -z, pX[b], pY[b], 0.0f );
+			SetMeshVertex( v[3], pX[b], pY[b],  z, pX[b], pY[b], 0.0f );
+		}
+		else
+		{
+			// Perpendicular to the edge, pointing away from the centroid
+			GLfloat nx = pY[b] - pY[a];
+			GLfloat ny = pX[a] - pX[b];
+			GLfloat l = sqrt( nx * nx + ny * ny );
+
+			if( nx * ((pX[a] + pX[b]) / 2.0f - cx) + ny * ((pY[a] + pY[b]) / 2.0f - cy) < 0.0f )
+			{
+				l = -l;
+			}
+
+			nx /= l;
+			ny /= l;
+
+			SetMeshVertex( v[0], pX[a], pY[a], -z, nx, ny, 0.0f );
+			SetMeshVertex( v[1], pX[a], pY[a],  z, nx, ny, 0.0f );
+			SetMeshVertex( v[2], pX[b], pY[b], -z, nx, ny, 0.0f );
+			SetMeshVertex( v[3], pX[b], pY[b],  z, nx, ny, 0.0f );
+		}
+
+		GLushort k = n * 2 + i * 4;
+
+		pIndices[mesh.nIndices++] = k;
+		pIndices[mesh.nIndices++] = k + 1;
+		pIndices[mesh.nIndices++] = k + 2;
+
+		pIndices[mesh.nIndices++] = k + 2;
+		pIndices[mesh.nIndices++] = k + 1;
+		pIndices[mesh.nIndices++] = k + 3;
+	}
+
+	glGenBuffers( 1, &mesh.vertexBuffer );
+	glBindBuffer( GL_ARRAY_BUFFER, mesh.vertexBuffer );
+	glBufferData( GL_ARRAY_BUFFER, n * 6 * sizeof( VertexData ), pVertices, GL_STATIC_DRAW );
+	glBindBuffer( GL_ARRAY_BUFFER, 0 );
+
+	glGenBuffers( 1, &mesh.indexBuffer );
+	glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, mesh.indexBuffer );
+	glBufferData( GL_ELEMENT_ARRAY_BUFFER, mesh.nIndices * sizeof( GLushort ), pIndices, GL_STATIC_DRAW );
+	glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, 0 );
+
+	delete[] pVertices;
+	delete[] pIndices;
+}
+
+// Build a wheel mesh with n segments
+GLvoid BuildWheelMesh( MeshData & mesh, unsigned int n, GLfloat z )
+{
+	unsigned int i;
+
+	const unsigned int nMax = 31;
+	if( n >= nMax ) n = nMax;
+	GLfloat x[nMax], y[nMax];
+
+	for( i = 0 ; i < n; ++i ) {
+		GLfloat t = M_PI * 2 * (-0.5f + (GLfloat)(int( i ) - 1) / n);
+		x[i] = sin( t );
+		y[i] = cos( t );
+	}
+
+	BuildPrismMesh( mesh, x, y, n, z, true );
+}
+
+// Build a chassis mesh for a vehicle type from the vehicleData table
+GLvoid BuildShapeMesh( MeshData & mesh, unsigned int nType, float fScale, float z )
+{
+	unsigned int i;
+	unsigned int nVertices, nScale;
+	char * pVertices = GetVehicleData( nType, nVertices, nScale );
+	GLfloat x[MAX_SHAPE_VERTICES], y[MAX_SHAPE_VERTICES];
+
+	if( nVertices > MAX_SHAPE_VERTICES ) nVertices = MAX_SHAPE_VERTICES;
+
+	for( i = 0; i < nVertices; ++i )
+	{
+		x[i] = float( pVertices[i*2] ) / float( nScale ) * fScale;
+		y[i] = float( pVertices[i*2+1] ) / float( nScale ) * fScale;
+	}
+
+	BuildPrismMesh( mesh, x, y, nVertices, z, false );
+}
+
+// Bind the buffers of a mesh and set the vertex pointers
+GLvoid BindMesh( const MeshData & mesh )
+{
+	glBindBuffer( GL_ARRAY_BUFFER, mesh.vertexBuffer );
+	glVertexPointer( 3, GL_FLOAT, sizeof( VertexData ), BUFFER_OFFSET(0) );
+	glNormalPointer( GL_FLOAT, sizeof( VertexData ), BUFFER_OFFSET(12) );
+	glTexCoordPointer( 2, GL_FLOAT, sizeof( VertexData ), BUFFER_OFFSET(24) );
+
+	glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, mesh.indexBuffer );
+}
+
+// Draw a mesh stored in buffers
+GLvoid DrawMesh( const MeshData & mesh )
+{
+	BindMesh( mesh );
+	glDrawElements( GL_TRIANGLES, mesh.nIndices, GL_UNSIGNED_SHORT, BUFFER_OFFSET(0) );
+
+	glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, 0 );
+	glBindBuffer( GL_ARRAY_BUFFER, 0 );
+}
+
+GLvoid InitStreamBuffer( StreamBuffer & stream, GLsizeiptr nSize )
+{
+	stream.nSize   = nSize;
+	stream.nOffset = 0;
+
+	glGenBuffers( 1, &stream.buffer );
+	glBindBuffer( GL_ARRAY_BUFFER, stream.buffer );
+	glBufferData( GL_ARRAY_BUFFER, stream.nSize, NULL, GL_STREAM_DRAW );
+	glBindBuffer( GL_ARRAY_BUFFER, 0 );
+}
+
+// Append data to the stream buffer, leaves the buffer bound and returns the offset of the data in it
+GLintptr StreamData( StreamBuffer & stream, const GLvoid * pData, GLsizeiptr nBytes )
+{
+	glBindBuffer( GL_ARRAY_BUFFER, stream.buffer );
+
+	// Grow the ring when a single upload does not fit, the next orphan allocates the new size
+	while( nBytes > stream.nSize )
+	{
+		stream.nSize *= 2;
+		stream.nOffset = stream.nSize;
+	}
+
+	// Ring is full, orphan the storage instead of waiting until the GPU is done with it
+	if( stream.nOffset + nBytes > stream.nSize )
+	{
+		glBufferData( GL_ARRAY_BUFFER, stream.nSize, NULL, GL_STREAM_DRAW );
+		stream.nOffset = 0;
+	}
+
+	const GLintptr offset = stream.nOffset;
+	GLvoid * pDest = NULL;
+
+	// Range behind the write offset is never read by pending draws, no synchronization needed
+	if( g_bMapBufferRange )
+	{
+		pDest = glMapBufferRange( GL_ARRAY_BUFFER, offset, nBytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT );
+	}
+
+	if( pDest )
+	{
+		memcpy( pDest, pData, nBytes );
+		glUnmapBuffer( GL_ARRAY_BUFFER );
+	}
+	else
+	{
+		glBufferSubData( GL_ARRAY_BUFFER, offset, nBytes, pData );
+	}
+
+	stream.nOffset += (nBytes + STREAM_BUFFER_ALIGN - 1) & ~(STREAM_BUFFER_ALIGN - 1);
+	return offset;
+}
+
+// Draw vertices from the stream buffer, requires the vertex and texture coordinate arrays enabled
+GLvoid DrawStream( GLenum mode, const VertexData * pVertices, GLsizei nVertices )
+{
+	const GLintptr offset = StreamData( streamBuffer, pVertices, nVertices * sizeof( VertexData ) );
+	glVertexPointer( 3, GL_FLOAT, sizeof( VertexData ), BUFFER_OFFSET( offset ) );
+	glNormalPointer( GL_FLOAT, sizeof( VertexData ), BUFFER_OFFSET( (offset + 12) ) );
+	glTexCoordPointer( 2, GL_FLOAT, sizeof( VertexData ), BUFFER_OFFSET( (offset + 24) ) );
+
+	glDrawArrays( mode, 0, nVertices );
+
+	glBindBuffer( GL_ARRAY_BUFFER, 0 );
+}
+
+// Draw a quad over the unit square, textured with the part of the render targets in use
+GLvoid DrawScreenQuad( GLvoid )
+{
+	const GLfloat s = g_fTargetScale[0], t = g_fTargetScale[1];
+	const VertexData quad[] = {
+		{ 0, 0, 0,	0, 0, 1,	0, 0 },
+		{ 1, 0, 0,	0, 0, 1,	s, 0 },
+		{ 1, 1, 0,	0, 0, 1,	s, t },
+		{ 0, 1, 0,	0, 0, 1,	0, t }
+	};
+
+	glEnableClientState( GL_VERTEX_ARRAY );
+	glEnableClientState( GL_TEXTURE_COORD_ARRAY );
+	glEnableClientState( GL_NORMAL_ARRAY );
+	DrawStream( GL_TRIANGLE_FAN, quad, 4 );
+	glDisableClientState( GL_VERTEX_ARRAY );
+	glDisableClientState( GL_TEXTURE_COORD_ARRAY );
+	glDisableClientState( GL_NORMAL_ARRAY );
+}
+
+// Edge quality in use, auto picks the half resolution pass on large screens
+unsigned int GetEdgeQuality( GLvoid )
+{
+	unsigned int nQuality = g_nEdgeQuality;
+
+	if( nQuality == EDGE_QUALITY_AUTO )
+	{
+		nQuality = g_nViewWidth * g_nViewHeight > EDGE_HALF_PIXELS ? EDGE_QUALITY_HALF : EDGE_QUALITY_FULL;
+	}
+
+	// Programs that failed to build fall back to the full pass
+	if( nQuality == EDGE_QUALITY_HALF && (!GetProgram( PROGRAM_EDGE_HALF ) || !GetProgram( PROGRAM_EDGE_COMPOSITE )) )
+	{
+		nQuality = EDGE_QUALITY_FULL;
+	}
+
+	return nQuality;
+}
+
+// Draw all active shaped in the physics space -> rocks and character
+void DrawActiveShapes( void * shape, void * data )
+{
+	const cpShape * pShape = (cpShape *)shape;
+	const cpBody * pBody  = pShape->body;
+
+	switch( pShape->collision_type )
+	{
+		case T_ROCK:
+			{	// Rock object
+				cpCircleShape * pCircle = (cpCircleShape *)pShape;
+				cpVect c = cpvadd( pBody->p, cpvrotate( pCircle->c, pBody->rot ) );
+
+				glPushMatrix();
+					glBindTexture( GL_TEXTURE_2D, textures[0] );
+					glTranslatef( c.x, c.y, -0.5f - (pCircle->r / 2.0f) );
+					glRotatef( pBody->a * 180.0f / (cpFloat) M_PI, 0.0f, 0.0f, 1.0f );
+					glScalef( pCircle->r * (WORLD_SCALE * 5.5f), pCircle->r * (WORLD_SCALE * 5.5f), pCircle->r * (WORLD_SCALE * 5.5f) );
+					DrawMesh( meshRock );
+				glPopMatrix();
+			}
+			break;
+		case T_WHEEL_TRAILER:
+		case T_WHEEL:
+			{	// Wheel object
+				cpCircleShape * pCircle = (cpCircleShape *)pShape;
+				cpVect c = cpvadd( pBody->p, cpvrotate( pCircle->c, pBody->rot ) );
+
+				glPushMatrix();
+					glBindTexture( GL_TEXTURE_2D, textures[0] );
+					glPushMatrix();
+						glTranslatef( c.x, c.y, -0.5f - WORLD_SCALE );
+						glRotatef( pBody->a * 180.0f / (cpFloat) M_PI, 0.0f, 0.0f, 1.0f );
+						glScalef( pCircle->r, pCircle->r, pCircle->r );
+						DrawMesh( meshWheel );
+					glPopMatrix();
+					glPushMatrix();
+						glTranslatef( c.x, c.y, -0.5f + WORLD_SCALE );
+						glRotatef( pBody->a * 180.0f / (cpFloat) M_PI, 0.0f, 0.0f, 1.0f );
+						glScalef( pCircle->r, pCircle->r, pCircle->r );
+						DrawMesh( meshWheel );
+					glPopMatrix();
+				glPopMatrix();
+
+			}
+			break;
+		case T_CHASSIS:
+			{
+				VehicleData * pData = PoolGet( g_Vehicles, SHAPE_HANDLE( pShape ) );
+				const cpVect p = pBody->p;
+
+				if( !pData ) break;
+
+				glPushMatrix();
+					glBindTexture( GL_TEXTURE_2D, textures[0] );
+					glTranslatef( p.x, p.y, -0.5f );
+					glRotatef( pBody->a * 180.0f / (cpFloat) M_PI, 0.0f, 0.0f, 1.0f );
+					
+					if( pData->npc )
+					{
+						glRotatef( 180.0f, 0.0f, 1.0f, 0.0f );
+					}
+
+					DrawMesh( meshChassis[pData->carType] );
+				glPopMatrix();
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+// Add an instance to a list, growing the list when full
+void AddInstance( InstanceList & list, float x, float y, float z, float a, float scale, float flip )
+{
+	if( list.nCount == list.nMax )
+	{
+		list.nMax = ( list.nMax ? list.nMax * 2 : 64 );
+
+		InstanceData* pData = new InstanceData[list.nMax];
+		if( list.pData )
+		{
+			memcpy( pData, list.pData, list.nCount * sizeof( InstanceData ) );
+			delete[] list.pData;
+		}
+		list.pData = pData;
+	}
+
+	InstanceData & instance = list.pData[list.nCount++];
+	instance.x = x;
+	instance.y = y;
+	instance.z = z;
+	instance.a = a;
+	instance.scale = scale;
+	instance.flip = flip;
+}
+
+// Part of the world seen by the camera down to the given depth, as a bounding box
+cpBB GetViewBB( GLfloat fDepth, GLfloat fMargin )
+{
+	const GLfloat fHalfHeight = fDepth * tan( CAMERA_FOV * 0.5f * (M_PI / 180.0f) ) + fMargin;
+	const GLfloat fHalfWidth  = fHalfHeight * g_fViewAspect + fMargin;
+
+	return cpBBNew( -g_fXScroll - fHalfWidth, CAMERA_HEIGHT - fHalfHeight, -g_fXScroll + fHalfWidth, CAMERA_HEIGHT + fHalfHeight );
+}
+
+// Spatial hash query callbacks, the query object is unused
+void DrawVisibleShape( void * obj, void * shape, void * data )
+{
+	DrawActiveShapes( shape, data );
+}
+
+// Collect the transforms of all active shapes in the physics space, see DrawActiveShapes
+void CollectActiveShapes( void * shape, void * data )
+{
+	const cpShape * pShape = (cpShape *)shape;
+	const cpBody * pBody  = pShape->body;
+
+	switch( pShape->collision_type )
+	{
+		case T_ROCK:
+			{	// Rock object
+				cpCircleShape * pCircle = (cpCircleShape *)pShape;
+				cpVect c = cpvadd( pBody->p, cpvrotate( pCircle->c, pBody->rot ) );
+
+				AddInstance( instancesRock, c.x, c.y, -0.5f - (pCircle->r / 2.0f), pBody->a, pCircle->r * (WORLD_SCALE * 5.5f), 1.0f );
+			}
+			break;
+		case T_WHEEL_TRAILER:
+		case T_WHEEL:
+			{	// Wheel object, one on each side
+				cpCircleShape * pCircle = (cpCircleShape *)pShape;
+				cpVect c = cpvadd( pBody->p, cpvrotate( pCircle->c, pBody->rot ) );
+
+				AddInstance( instancesWheel, c.x, c.y, -0.5f - WORLD_SCALE, pBody->a, pCircle->r, 1.0f );
+				AddInstance( instancesWheel, c.x, c.y, -0.5f + WORLD_SCALE, pBody->a, pCircle->r, 1.0f );
+			}
+			break;
+		case T_CHASSIS:
+			{
+				VehicleData * pData = PoolGet( g_Vehicles, SHAPE_HANDLE( pShape ) );
+				if( !pData ) break;
+
+				AddInstance( instancesChassis[pData->carType], pBody->p.x, pBody->p.y, -0.5f, pBody->a, 1.0f, pData->npc ? -1.0f : 1.0f );
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+void CollectVisibleShape( void * obj, void * shape, void * data )
+{
+	CollectActiveShapes( shape, data );
+}
+
+// Draw all instances in a list with a single draw call
+GLvoid DrawInstances( const MeshData & mesh, InstanceList & list )
+{
+	if( !list.nCount )
+	{
+		return;
+	}
+
+	const GLintptr offset = StreamData( streamBuffer, list.pData, list.nCount * sizeof( InstanceData ) );
+	glVertexAttribPointer( attribInstancePosition, 4, GL_FLOAT, GL_FALSE, sizeof( InstanceData ), BUFFER_OFFSET( offset ) );
+	glVertexAttribPointer( attribInstanceScale, 2, GL_FLOAT, GL_FALSE, sizeof( InstanceData ), BUFFER_OFFSET( (offset + 16) ) );
+
+	BindMesh( mesh );
+	glDrawElementsInstancedARB( GL_TRIANGLES, mesh.nIndices, GL_UNSIGNED_SHORT, BUFFER_OFFSET(0), list.nCount );
+
+	glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, 0 );
+	glBindBuffer( GL_ARRAY_BUFFER, 0 );
+
+	list.nCount = 0;
+}
+
+// Draw all active shapes in the physics space using one draw call per mesh
+GLvoid DrawActiveInstances( GLvoid )
+{
+	unsigned int i;
+
+	const cpBB bb = GetViewBB( CAMERA_DISTANCE + CULL_DEPTH, CULL_MARGIN );
+
+	// Sleeping shapes are kept in the static hash, the terrain in there is skipped by the callback
+	cpSpaceHashQuery( space->activeShapes, NULL, bb, &CollectVisibleShape, NULL );
+	cpSpaceHashQuery( space->staticShapes, NULL, bb, &CollectVisibleShape, NULL );
+
+	glUseProgram( GetProgram( PROGRAM_INSTANCED ) );
+	glBindTexture( GL_TEXTURE_2D, textures[0] );
+
+	glEnableVertexAttribArray( attribInstancePosition );
+	glEnableVertexAttribArray( attribInstanceScale );
+	glVertexAttribDivisorARB( attribInstancePosition, 1 );
+	glVertexAttribDivisorARB( attribInstanceScale, 1 );
+
+	DrawInstances( meshRock, instancesRock );
+	DrawInstances( meshWheel, instancesWheel );
+
+	for( i = 0; i < MAX_VEHICLE_TYPES; ++i )
+	{
+		DrawInstances( meshChassis[i], instancesChassis[i] );
+	}
+
+	glVertexAttribDivisorARB( attribInstancePosition, 0 );
+	glVertexAttribDivisorARB( attribInstanceScale, 0 );
+	glDisableVertexAttribArray( attribInstancePosition );
+	glDisableVertexAttribArray( attribInstanceScale );
+
+	glUseProgram( GetProgram( PROGRAM_LIGHTING ) );
+}
+
+// Build a single mesh holding a quad for every cloud
+GLvoid BuildCloudMesh( MeshData & mesh )
+{
+	unsigned int i, j, n = 0;
+	const unsigned int nClouds = (TERRAIN_SEGMENTS + 2) / 3;
+	const GLfloat corners[4][2] = { { 0.0f, 0.0f }, { 1.0f, 0.0f }, { 1.0f, 1.0f }, { 0.0f, 1.0f } };
+
+	VertexData* pVertices = new VertexData[nClouds * 4];
+	GLushort* pIndices = new GLushort[nClouds * 6];
+
+	mesh.nIndices = 0;
+
+	// Fixed seed, so clouds are at the same positions every run
+	_srand( 10 );
+	for( i = 0 ; i < TERRAIN_SEGMENTS ; i += 3 )
+	{
+		GLfloat x = i + ((_rand() % 30 ) * 0.7f);
+		GLfloat y = 3.0f - (_rand() % 10) * 0.1f;
+
+		for( j = 0; j < 4; ++j )
+		{
+			SetMeshVertex( pVertices[n + j], x + corners[j][0], y + corners[j][1], -2.5f, 0.0f, 0.0f, 1.0f );
+			pVertices[n + j].s = corners[j][0];
+			pVertices[n + j].t = corners[j][1];
+		}
+
+		pIndices[mesh.nIndices++] = n;
+		pIndices[mesh.nIndices++] = n + 1;
+		pIndices[mesh.nIndices++] = n + 2;
+
+		pIndices[mesh.nIndices++] = n;
+		pIndices[mesh.nIndices++] = n + 2;
+		pIndices[mesh.nIndices++] = n + 3;
+
+		n += 4;
+	}
+
+	glGenBuffers( 1, &mesh.vertexBuffer );
+	glBindBuffer( GL_ARRAY_BUFFER, mesh.vertexBuffer );
+	glBufferData( GL_ARRAY_BUFFER, n * sizeof( VertexData ), pVertices, GL_STATIC_DRAW );
+	glBindBuffer( GL_ARRAY_BUFFER, 0 );
+
+	glGenBuffers( 1, &mesh.indexBuffer );
+	glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, mesh.indexBuffer );
+	glBufferData( GL_ELEMENT_ARRAY_BUFFER, mesh.nIndices * sizeof( GLushort ), pIndices, GL_STATIC_DRAW );
+	glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, 0 );
+
+	delete[] pVertices;
+	delete[] pIndices;
+}
+
+// Draw all clouds in a single draw call. Blending would mix the packed normal and depth of the
+// G-buffer, so only the colour target is written and the sky stays in the G-buffer below them
+GLvoid DrawClouds( GLvoid )
+{
+	const GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT0_EXT, GL_COLOR_ATTACHMENT1_EXT };
+
+	glDrawBuffer( drawBuffers[0] );
+
+	glEnable( GL_BLEND );
+	glEnable( GL_ALPHA_TEST );
+	glAlphaFunc( GL_GREATER, 0.1f );
+
+	glBindTexture( GL_TEXTURE_2D, textures[2] );
+
+	DrawMesh( meshClouds );
+
+	glBindTexture( GL_TEXTURE_2D, 0 );
+
+	glDisable( GL_ALPHA_TEST );
+	glDisable( GL_BLEND );
+
+	glDrawBuffers( 2, drawBuffers );
+}
+
+// Range of terrain vertices in view down to the given depth
+GLvoid GetTerrainRange( GLfloat fDepth, int & nLeft, int & nRight )
+{
+	cpBB bb = GetViewBB( fDepth, 0.0f );
+
+	nLeft  = int( floor( bb.l / g_fTerrainStep ) ) - 1;
+	nRight = int( ceil( bb.r / g_fTerrainStep ) ) + 1;
+}
+
+// Draw the part of the front and top strips of a terrain layer of a chunk within a range of vertices
+GLvoid DrawTerrain( const TerrainChunk & chunk, unsigned int nLayer, int nLeft, int nRight )
+{
+	nLeft  = nLeft < chunk.nFirst ? chunk.nFirst : nLeft;
+	nRight = nRight > chunk.nLast ? chunk.nLast : nRight;
+
+	if( chunk.nChunk < 0 || nRight <= nLeft )
+	{
+		return;
+	}
+
+	for( unsigned int i = 0; i < 2; ++i )
+	{
+		glBindBuffer( GL_ARRAY_BUFFER, chunk.buffers[nLayer * 2 + i] );
+		glVertexPointer( 3, GL_FLOAT, sizeof( VertexData ), BUFFER_OFFSET(0) );
+		glNormalPointer( GL_FLOAT, sizeof( VertexData ), BUFFER_OFFSET(12) );
+		glTexCoordPointer( 2, GL_FLOAT, sizeof( VertexData ), BUFFER_OFFSET(24) );
+
+		// Two vertices per segment
+		glDrawArrays( GL_TRIANGLE_STRIP, (nLeft - chunk.nFirst) * 2, (nRight - nLeft + 1) * 2 );
+	}
+}
+
+// Draw the complete world
+GLint DrawWorld( GLvoid )
+{
+	int nLeft, nRight;
+	unsigned int i;
+
+	glLoadIdentity();
+
+	// Default translation
+	g_fXScroll = -g_Camera.pivot->body->p.x;
+	glTranslatef( g_fXScroll, -CAMERA_HEIGHT, -CAMERA_DISTANCE );
+
+	// For every active shape in view, draw it
+	if( g_bInstancing )
+	{
+		DrawActiveInstances();
+	}
+	else
+	{
+		const cpBB bb = GetViewBB( CAMERA_DISTANCE + CULL_DEPTH, CULL_MARGIN );
+
+		// Sleeping shapes are kept in the static hash
+		cpSpaceHashQuery( space->activeShapes, NULL, bb, &DrawVisibleShape, NULL );
+		cpSpaceHashQuery( space->staticShapes, NULL, bb, &DrawVisibleShape, NULL );
+	}
+
+	// Draw front and top of heightmap, only the segments in view are drawn
+	glBindTexture( GL_TEXTURE_2D, textures[1] );
+
+	GetTerrainRange( CAMERA_DISTANCE + CULL_DEPTH, nLeft, nRight );
+	for( i = 0; i < TERRAIN_MAX_CHUNKS; ++i )
+	{
+		DrawTerrain( g_TerrainChunks[i], TERRAIN_ROAD, nLeft, nRight );
+	}
+
+	GetTerrainRange( CAMERA_DISTANCE + CULL_DEPTH_MOUNTAIN, nLeft, nRight );
+
+	glPushMatrix();
+		glTranslatef( 0.0f, 0.0f, -1.0f );
+
+		for( i = 0; i < TERRAIN_MAX_CHUNKS; ++i )
+		{
+			DrawTerrain( g_TerrainChunks[i], TERRAIN_MOUNTAIN, nLeft, nRight );
+		}
+	glPopMatrix();
+
+	glBindTexture( GL_TEXTURE_2D, 0 );
+
+	DrawClouds();
+
+	return TRUE;
+}
+
+// Print text to the screen
+GLvoid glPrintf( const char* szFormat, ... )
+{
+	char	text[256];
+	va_list pArguments;
+
+	// No text or no font, do nothing
+	if ( szFormat == NULL || !fontList )
+	{
+		return;
+	}
+
+	va_start( pArguments, szFormat );
+	    wvsprintf( text, szFormat, pArguments );
+	va_end( pArguments );
+
+	glPushAttrib( GL_LIST_BIT );	
+	glListBase( fontList - 32 );
+	glCallLists( strlen( text ), GL_UNSIGNED_BYTE, text );
+	glPopAttrib();
+}
+
+// Draw the times of the last frame in microseconds
+GLvoid DrawProfileOverlay( GLvoid )
+{
+	char szName[16];
+	unsigned int i;
+
+	for( i = 0; i < COUNT_PROFILE; ++i )
+	{
+		glRasterPos2f( -0.4f, 0.28f - i * 0.025f );
+		glPrintf( "%s: %d us", GetProfileName( i, szName ), int( g_dProfileLast[i] * 1000000.0 ) );
+	}
+}
+
+// Draw the complete scene
+// Render the current state of the world, the physics is stepped by the caller
+GLint RenderGLScene( GLvoid )
+{
+	VehicleData * pPcVehicle;
+
+	// Diffuse light position, following path
+	const GLfloat diffusePosition[]  = { 2.8f, 10.0f, 10.0f, 1.0f };
+
+	const GLfloat diffuseColor[] = { 0.65f, 0.65f, 0.65f, 1.0f };
+
+	// Make sure not to scroll further than left and right boundaries
+	pPcVehicle = PoolGet( g_Vehicles, g_hPcVehicle );
+	if( pPcVehicle && pPcVehicle->chassis->body->p.x > (g_fTerrainStep * LEVEL_SCROLL_MIN) && pPcVehicle->chassis->body->p.x < (g_fTerrainStep * LEVEL_SCROLL_MAX))
+	{
+		g_fXScroll = pPcVehicle->chassis->body->p.x * -1.0f;
+	}
+
+	glEnableClientState( GL_VERTEX_ARRAY );
+	glEnableClientState( GL_TEXTURE_COORD_ARRAY );
+	glEnableClientState( GL_NORMAL_ARRAY );
+
+	glEnable( GL_DEPTH_TEST );
+
+	glEnable( GL_LIGHT0 );
+	glLightfv( GL_LIGHT0, GL_POSITION, diffusePosition );
+	glLightfv( GL_LIGHT0, GL_DIFFUSE, diffuseColor );
+
+	//Render world to FBO for use with fragment shaders
+	glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, renderTargets[TARGET_SCENE].fbo );
+
+	//Bind gl_FragData[0] to GL_COLOR_ATTACHMENT0_EXT and gl_FragData[1] to GL_COLOR_ATTACHMENT1_EXT
+	GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT0_EXT, GL_COLOR_ATTACHMENT1_EXT };
+	glDrawBuffers( 2, drawBuffers );
+
+	ProfileBeginGpu( PROFILE_GPU_SCENE );
+	ProfileBegin( PROFILE_WORLD );
+
+	glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
+
+	//Render world with textures
+	glUseProgram( GetProgram( PROGRAM_LIGHTING ) );
+		glEnable( GL_TEXTURE_2D );
+		DrawWorld();
+		glDisable( GL_TEXTURE_2D );
+	glUseProgram( 0 );
+
+#ifdef OFFSCREEN
+	// Software rendering is deferred, wait for it so the pass time covers it
+	glFinish();
+#endif
+
+	ProfileEnd( PROFILE_WORLD );
+	ProfileEndGpu( PROFILE_GPU_SCENE );
+
+	glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, 0 );
+	glDrawBuffer( GL_BACK );
+	//End of FBO rendering
+
+	glDisable( GL_LIGHT0 );
+
+	glDisableClientState( GL_VERTEX_ARRAY );
+	glDisableClientState( GL_TEXTURE_COORD_ARRAY );
+	glDisableClientState( GL_NORMAL_ARRAY );
+
+	glDisable( GL_DEPTH_TEST );
+
+	ProfileBeginGpu( PROFILE_GPU_EDGE );
+	ProfileBegin( PROFILE_EDGE );
+
+	//Render program edges
+	glMatrixMode( GL_PROJECTION );
+	glPushMatrix();
+		glLoadIdentity();
+		gluOrtho2D( 0, 1, 0, 1 );
+		
+		glMatrixMode( GL_MODELVIEW );
+		glPushMatrix();
+			glLoadIdentity();
+			
+			const unsigned int nQuality = GetEdgeQuality();
+
+			glEnable( GL_TEXTURE_2D );
+
+			// 1
+			glActiveTexture( GL_TEXTURE0 ); glBindTexture( GL_TEXTURE_2D, GetTargetTexture( TARGET_SCENE, 0 ) );
+			glActiveTexture( GL_TEXTURE1 ); glBindTexture( GL_TEXTURE_2D, GetTargetTexture( TARGET_SCENE, 1 ) );
+
+			// 2
+			if( nQuality == EDGE_QUALITY_HALF )
+			{
+				// Edges at half resolution, then upsampled onto the colour
+				glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, renderTargets[TARGET_EDGE].fbo );
+				glViewport( 0, 0, (g_nViewWidth + 1) / 2, (g_nViewHeight + 1) / 2 );
+
+				glUseProgram( GetProgram( PROGRAM_EDGE_HALF ) );
+				DrawScreenQuad();
+
+				glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, 0 );
+				glViewport( 0, 0, g_nViewWidth, g_nViewHeight );
+
+				glActiveTexture( GL_TEXTURE2 ); glBindTexture( GL_TEXTURE_2D, GetTargetTexture( TARGET_EDGE, 0 ) );
+				glUseProgram( GetProgram( PROGRAM_EDGE_COMPOSITE ) );
+			}
+			else
+			{
+				glUseProgram( GetProgram( PROGRAM_EDGE ) );
+			}
+
+			// 3
+			DrawScreenQuad();
+
+			glActiveTexture( GL_TEXTURE2 ); glBindTexture( GL_TEXTURE_2D, 0 );
+			glActiveTexture( GL_TEXTURE1 ); glBindTexture( GL_TEXTURE_2D, 0 );
+			glActiveTexture( GL_TEXTURE0 ); glBindTexture( GL_TEXTURE_2D, 0 );
+
+			glDisable( GL_TEXTURE_2D );
+
+			glUseProgram( 0 );
+
+		glPopMatrix();
+		glMatrixMode( GL_PROJECTION );
+	glPopMatrix();
+	glMatrixMode( GL_MODELVIEW );
+
+#ifdef OFFSCREEN
+	glFinish();
+#endif
+
+	ProfileEnd( PROFILE_EDGE );
+	ProfileEndGpu( PROFILE_GPU_EDGE );
+
+	ProfileBegin( PROFILE_HUD );
+
+	//Render score and multiplier text
+	glLoadIdentity();
+	glTranslatef( 0.0f, 0.0f, -1.0f );
+
+	glColor3ub( 255, 255, 255 );
+
+	glRasterPos2f( -0.4f, 0.38f );
+ 	glPrintf( "Score: %d", g_nScore );
+
+	glRasterPos2f( -0.4f, 0.35f );
+ 	glPrintf( "Multiplier: %dx", int( g_fMultiplier ) );
+
+	glRasterPos2f( -0.4f, 0.32f );
+ 	glPrintf( "Level: %d", int( g_nLevel ) );
+
+	if( g_bProfileOverlay )
+	{
+		DrawProfileOverlay();
+	}
+
+	ProfileEnd( PROFILE_HUD );
+
+	RestoreBodyStates();
+
+	ProfileFrame();
+
+	return TRUE;
+}
+
+GLint DrawGLScene( GLvoid )
+{
+	// Step the physics and render bodies in between the last two ticks
+	AdvanceSpace();
+	InterpolateBodyStates( g_fPhysicsAlpha );
+
+	return RenderGLScene();
+}
+
+///***********************************************************///
+
+///***********************************************************///
+/// Shader initialization
+///***********************************************************///
+
+//Create a shader with given type, size and store it in data pointed to
+GLint CreateShader( GLenum shaderType, GLint dataSize, const GLchar* data )
+{
+	GLuint shader = glCreateShader( shaderType );
+
+	if( shader )
+	{
+		glShaderSource( shader, 1, &data, &dataSize );
+		glCompileShader( shader );
+
+		GLint status = GL_FALSE;
+		glGetShaderiv( shader, GL_COMPILE_STATUS, &status );
+
+		if( status == GL_FALSE )
+		{
+			GLchar log[1024];
+			GLint logsize;
+
+			glGetShaderInfoLog( shader, 1024, &logsize, log );
+
+			MessageBox( NULL, "Failed to create shaders, your hardware seems to be unsupported.", "ERROR", MB_OK | MB_ICONEXCLAMATION );
+			
+#ifdef MEAN
+			return 0;
+#endif
+		}
+	}
+
+	return shader;
+}
+
+GLint CreateProgram( GLint vertexSize, const GLchar* vertexShader, GLint fragmentSize, const GLchar* fragmentShader )
+{
+	GLint vShader, fShader, program = 0;
+
+	vShader = CreateShader( GL_VERTEX_SHADER, vertexSize, vertexShader );	
+	fShader = CreateShader( GL_FRAGMENT_SHADER, fragmentSize, fragmentShader );
+
+	if( vShader && fShader )
+	{
+		program = glCreateProgram();
+		glAttachShader( program, vShader );
+		glAttachShader( program, fShader );
+		glLinkProgram( program );
+
+		GLint status = GL_FALSE;
+		glGetProgramiv( program, GL_LINK_STATUS, &status );
+
+		if( status == GL_FALSE )
+		{
+			GLchar log[1024];
+			GLint logsize;
+
+			glGetProgramInfoLog( program, 1024, &logsize, log );
+
+			MessageBox( NULL, log, "Failed to link shaders", MB_OK | MB_ICONEXCLAMATION );
+
+			glDeleteProgram( program );
+			program = 0;
+		}
+	}
+
+	return program;
+}
+
+// Build a registered program, resolve all its uniform locations and bind its samplers
+GLuint LoadProgram( unsigned int nProgram )
+{
+	ProgramData & data = programs[nProgram];
+	unsigned int i;
+
+	data.program = CreateProgram( data.nVertexSize, data.szVertexShader, data.nFragmentSize, data.szFragmentShader );
+
+	for( i = 0; i < COUNT_UNIFORMS; ++i )
+	{
+		data.uniforms[i] = -1;
+	}
+
+	if( data.program )
+	{
+		glUseProgram( data.program );
+
+		for( i = 0; i < COUNT_UNIFORMS; ++i )
+		{
+			data.uniforms[i] = glGetUniformLocation( data.program, uniformData[i].szName );
+
+			if( data.uniforms[i] != -1 && uniformData[i].nSampler >= 0 )
+			{
+				glUniform1i( data.uniforms[i], uniformData[i].nSampler );
+			}
+		}
+
+		glUseProgram( 0 );
+	}
+
+	return data.program;
+}
+///***********************************************************///
+
+///***********************************************************///
+/// Texture initialization
+///***********************************************************///
+
+// Binds the data of a given .tar file to position in data to be
+// bound to texture
+// See:  http://local.wasp.uwa.edu.au/~pbourke/dataformats/tga/
+// Note: Only reads uncompressed .tar files, data is BGRA
+bool BindTGAData( char* szFileName, int nDataPosition )
+{
+	FILE* pFile;
+	short int w = 0, h = 0;
+
+	if( sizeof( int ) != 4 )
+	{
+		return FALSE;
+	}
+
+	if( !(pFile = fopen( szFileName, "rb" )) )
+	{
+		return false;
+	}
+
+	fseek( pFile, 12, SEEK_SET );
+	fread( &w, sizeof( w ), 1, pFile );
+	fread( &h, sizeof( h ), 1, pFile );
+
+	// Never past the 256x256 texture data, sizes are signed in the file
+	if( w <= 0 || h <= 0 || w > 256 || h > 256 )
+	{
+		fclose( pFile );
+		return false;
+	}
+
+	fseek( pFile, 18, SEEK_SET );
+	fread( data[nDataPosition], 4, w * h, pFile );
+
+	fclose( pFile );
+
+	return true;
+}
+
+// Creates a checkboard-like pattern and binds it to position in data
+void BindCheckImage( int nDataPosition )
+{
+   int c;
+    
+   for ( int y = 0 ; y < 256 ; ++y ) 
+   {
+      for ( int x = 0 ; x < 256 ; ++x ) 
+	  {
+         c = (( (( (x & 0x8) == 0) ^ ( (y & 0x8) == 0 )) )) * 255;
+         data[nDataPosition][y][x][2] = (GLubyte) c;
+         data[nDataPosition][y][x][1] = (GLubyte) c;
+         data[nDataPosition][y][x][0] = (GLubyte) c;
+		 data[nDataPosition][y][x][3] = (GLubyte) 255;
+      }
+   }
+}
+
+// Creates a grass-like pattern and binds it to position in data
+void BindGrassImage( int nValue, int nDataPosition )
+{
+	for ( int x = 0; x < 256 ; ++x )
+	{
+		for ( int y = 0; y < 256 ; ++y )
+		{
+			GLubyte color = (GLubyte) (128 + _rand() % 41);
+
+			data[nDataPosition][y][x][2] = 0;
+			data[nDataPosition][y][x][1] = color * ( float( nValue ) / 100.0f);
+			data[nDataPosition][y][x][0] = 0;
+			data[nDataPosition][y][x][3] = 255;
+		}
+	}
+}
+
+// Load all textures
+GLint LoadGLTextures( GLvoid )
+{
+	BindCheckImage( 0 );
+	BindGrassImage( 93, 1 );
+	BindTGAData( "cloud.tga", 2 );
+
+	if ( data != NULL )
+	{
+		int nCountTextures = sizeof( data ) / sizeof( *data );
+
+		glPixelStorei( GL_UNPACK_ALIGNMENT, 1 );
+
+		glGenTextures( nCountTextures, textures );
+
+		//Check texture
+		glBindTexture( GL_TEXTURE_2D, textures[0] );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST );
+		gluBuild2DMipmaps( GL_TEXTURE_2D, GL_RGBA, 256, 256, GL_BGRA, GL_UNSIGNED_BYTE, data[0] );
+
+		//Green noise (mountain)
+		glBindTexture( GL_TEXTURE_2D, textures[1] );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST );
+		gluBuild2DMipmaps( GL_TEXTURE_2D, GL_RGBA, 256, 256, GL_BGRA, GL_UNSIGNED_BYTE, data[1] );
+
+		//Cloud
+		glBindTexture( GL_TEXTURE_2D, textures[2] );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
+		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_NEAREST );
+		gluBuild2DMipmaps( GL_TEXTURE_2D, GL_RGBA, 256, 256, GL_BGRA, GL_UNSIGNED_BYTE, data[2] );
+
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+///***********************************************************///
+
+///***********************************************************///
+/// OpenGL initialization
+///***********************************************************///
+
+// Initialize OpenGL extensions
+GLint InitExtensions( GLvoid )
+{
+	GLenum err = glewInit();
+
+	if( err != GLEW_OK )
+		return FALSE;
+
+#ifndef LINUX
+	GLchar* extensions = (GLchar*) glGetString( GL_EXTENSIONS );
+  
+	if ( strstr( extensions, "WGL_EXT_swap_control" ) )
+	{
+		wglSwapIntervalEXT    = (PFNWGLEXTSWAPCONTROLPROC) wglGetProcAddress( "wglSwapIntervalEXT" );
+		wglGetSwapIntervalEXT = (PFNWGLEXTGETSWAPINTERVALPROC) wglGetProcAddress( "wglGetSwapIntervalEXT" );
+	}
+	else
+	{
+		MessageBox( NULL, "Failed to initialize vsync, please enable vsync in your driver settings.", "ERROR", MB_OK | MB_ICONEXCLAMATION );
+	}
+#endif
+
+	// Check for FBO and depth texture support
+	if( !glewIsSupported( "GL_EXT_framebuffer_object GL_ARB_depth_texture" ) )
+		return FALSE;
+
+	// Check for instanced rendering support, otherwise shapes are drawn one by one
+	g_bInstancing = ( glewIsSupported( "GL_ARB_draw_instanced GL_ARB_instanced_arrays" ) == GL_TRUE );
+
+	// Check for unsynchronized buffer mapping, otherwise the stream buffer is filled with glBufferSubData
+	g_bMapBufferRange = ( glewIsSupported( "GL_ARB_map_buffer_range" ) == GL_TRUE );
+
+   return TRUE;
+}
+
+// Create the objects of all render targets, storage is allocated on resize
+GLvoid InitRenderTargets( GLvoid )
+{
+	for( unsigned int i = 0; i < COUNT_TARGETS; ++i )
+	{
+		RenderTarget & target = renderTargets[i];
+
+		glGenFramebuffersEXT( 1, &target.fbo );
+		glGenTextures( target.nColors, target.textures );
+
+		if( target.bDepth )
+		{
+			glGenRenderbuffersEXT( 1, &target.depthBuffer );
+		}
+
+		target.nWidth = target.nHeight = 0;
+	}
+}
+
+// Reallocate the attachments of a render target, only when its size changed
+GLint ResizeRenderTarget( RenderTarget & target, GLsizei nWidth, GLsizei nHeight )
+{
+	const GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT0_EXT, GL_COLOR_ATTACHMENT1_EXT };
+	unsigned int i;
+
+	nWidth  /= target.nDivisor;
+	nHeight /= target.nDivisor;
+
+	if( nWidth == target.nWidth && nHeight == target.nHeight )
+	{
+		return TRUE;
+	}
+
+	target.nWidth  = nWidth;
+	target.nHeight = nHeight;
+
+	glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, target.fbo );
+
+	// Depth is only tested, the edge pass reads linear depth from the G-buffer
+	if( target.bDepth )
+	{
+		glBindRenderbufferEXT( GL_RENDERBUFFER_EXT, target.depthBuffer );
+		glRenderbufferStorageEXT( GL_RENDERBUFFER_EXT, GL_DEPTH_COMPONENT24, nWidth, nHeight );
+		glBindRenderbufferEXT( GL_RENDERBUFFER_EXT, 0 );
+
+		glFramebufferRenderbufferEXT( GL_FRAMEBUFFER_EXT, GL_DEPTH_ATTACHMENT_EXT, GL_RENDERBUFFER_EXT, target.depthBuffer );
+	}
+
+	for( i = 0; i < target.nColors; ++i )
+	{
+		glBindTexture( GL_TEXTURE_2D, target.textures[i] );
+		glTexParameteri( GL_TEXTURE_2D,GL_TEXTURE_MAG_FILTER,target.formats[i].nFilter );
+		glTexParameteri( GL_TEXTURE_2D,GL_TEXTURE_MIN_FILTER,target.formats[i].nFilter );
+		glTexParameteri( GL_TEXTURE_2D,GL_TEXTURE_WRAP_S,GL_CLAMP_TO_EDGE );
+		glTexParameteri( GL_TEXTURE_2D,GL_TEXTURE_WRAP_T,GL_CLAMP_TO_EDGE );
+		glTexImage2D( GL_TEXTURE_2D, 0, target.formats[i].nInternalFormat, nWidth, nHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL );
+
+		glFramebufferTexture2DEXT( GL_FRAMEBUFFER_EXT, drawBuffers[i], GL_TEXTURE_2D, target.textures[i], 0 );
+	}
+
+	glDrawBuffers( target.nColors, drawBuffers );
+
+	GLenum status = glCheckFramebufferStatusEXT( GL_FRAMEBUFFER_EXT );
+
+	glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, 0 );
+	glBindTexture( GL_TEXTURE_2D, 0 );
+
+	if( status != GL_FRAMEBUFFER_COMPLETE_EXT ) {
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+// Resize all render targets for a screen, the screen size is rounded up to a bucket
+GLint ResizeRenderTargets( GLsizei nScreenWidth, GLsizei nScreenHeight )
+{
+	const GLsizei nWidth  = ((nScreenWidth  + TARGET_BUCKET - 1) / TARGET_BUCKET) * TARGET_BUCKET;
+	const GLsizei nHeight = ((nScreenHeight + TARGET_BUCKET - 1) / TARGET_BUCKET) * TARGET_BUCKET;
+	GLint bResult = TRUE;
+
+	for( unsigned int i = 0; i < COUNT_TARGETS; ++i )
+	{
+		if( !ResizeRenderTarget( renderTargets[i], nWidth, nHeight ) )
+		{
+			bResult = FALSE;
+		}
+	}
+
+	g_fTargetScale[0] = (GLfloat) nScreenWidth / nWidth;
+	g_fTargetScale[1] = (GLfloat) nScreenHeight / nHeight;
+
+	return bResult;
+}
+
+// Create font and store for use in glPrintf
+GLvoid CreateFont( GLvoid )
+{
+#if defined( OFFSCREEN )
+	// No system fonts, text is left out of the images
+	fontList = 0;
+#elif defined( X11 )
+	XFontStruct* pFont = XLoadQueryFont( g_pDisplay, "-*-helvetica-bold-r-normal--12-*-*-*-p-*-iso8859-1" );
+
+	if( !pFont && !(pFont = XLoadQueryFont( g_pDisplay, "fixed" )) )
+	{
+		fontList = 0;
+		return;
+	}
+
+	fontList = glGenLists( 96 );
+	glXUseXFont( pFont->fid, 32, 96, fontList );
+	XFreeFont( g_pDisplay, pFont );
+#else
+	HFONT	font;
+	HFONT	oldfont;
+
+	fontList = glGenLists( 96 );
+
+	font = CreateFont( -12,
+						0,
+						0,
+						0,
+						FW_BOLD,
+						FALSE,
+						FALSE,
+						FALSE,
+						ANSI_CHARSET,
+						OUT_TT_PRECIS,
+						CLIP_DEFAULT_PRECIS,
+						ANTIALIASED_QUALITY,
+						FF_DONTCARE|DEFAULT_PITCH,
+						"Verdana" );
+
+	oldfont = (HFONT) SelectObject( hDC, font );
+	wglUseFontBitmaps( hDC, 32, 96, fontList );
+	SelectObject( hDC, oldfont );
+	DeleteObject( font );
+#endif
+}
+
+// Delete the stored font
+GLvoid DeleteFont( GLvoid )
+{
+	glDeleteLists( fontList, 96 );
+}
+
+// Initialize OpenGL
+GLint InitGL( GLvoid )
+{
+	if( !LoadGLTextures() )
+	{
+		return FALSE;
+	}
+
+	if( !InitExtensions() )
+	{
+		return FALSE;
+	}
+
+	// Lighting shaders
+	if( !LoadProgram( PROGRAM_LIGHTING ) )
+	{
+#ifdef MEAN
+		return FALSE;
+#endif
+	}
+
+	// Edge shaders, a tier that fails to build falls back to the full pass
+	if( !LoadProgram( PROGRAM_EDGE ) )
+	{
+#ifdef MEAN
+		return FALSE;
+#endif
+	}
+
+	LoadProgram( PROGRAM_EDGE_HALF );
+	LoadProgram( PROGRAM_EDGE_COMPOSITE );
+
+	// Instancing shaders
+	if( g_bInstancing )
+	{
+		if( LoadProgram( PROGRAM_INSTANCED ) )
+		{
+			attribInstancePosition = glGetAttribLocation( GetProgram( PROGRAM_INSTANCED ), "instancePosition" );
+			attribInstanceScale    = glGetAttribLocation( GetProgram( PROGRAM_INSTANCED ), "instanceScale" );
+		}
+		else
+		{
+			g_bInstancing = false;
+		}
+	}
+
+	InitGpuProfile();
+
+	InitStreamBuffer( streamBuffer, STREAM_BUFFER_SIZE );
+
+	// Vertex buffers of the terrain chunk slots
+	for( unsigned int i = 0; i < TERRAIN_MAX_CHUNKS; ++i )
+	{
+		glGenBuffers( COUNT_TERRAIN_LAYERS * 2, g_TerrainChunks[i].buffers );
+	}
+
+	// Static meshes, one chassis per vehicle type
+	BuildRockMesh( meshRock, 30, 30, 0.2f );
+	BuildWheelMesh( meshWheel, 7, WORLD_SCALE );
+
+	for( unsigned int i = 0; i < (unsigned int) vehicleData[0] && i < MAX_VEHICLE_TYPES; ++i )
+	{
+		BuildShapeMesh( meshChassis[i], i, WORLD_SCALE, WORLD_SCALE );
+	}
+
+	BuildCloudMesh( meshClouds );
+
+	InitRenderTargets();
+
+	// The scissor keeps clears to the part of the render targets in use
+	glEnable( GL_SCISSOR_TEST );
+	
+	glShadeModel( GL_SMOOTH );
+	glClearColor( 0.06f, 0.7f, 0.9f, 1 );
+	glClearDepth( 1.0f );
+	glDepthFunc( GL_LESS );
+	glHint( GL_PERSPECTIVE_CORRECTION_HINT, GL_NICEST );
+	glHint( GL_LINE_SMOOTH_HINT, GL_NICEST );
+
+	glBlendFunc( GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA );
+	glDisable( GL_COLOR_MATERIAL );
+
+	CreateFont();
+
+	return TRUE;
+}
+
+// Texel size of the edge programs and the last texel in use, the half resolution pass steps over its own texels
+GLvoid SetEdgeUniforms( GLsizei width, GLsizei height )
+{
+	const RenderTarget & scene = renderTargets[TARGET_SCENE];
+	const RenderTarget & edge = renderTargets[TARGET_EDGE];
+	const GLfloat fFull[2] = { 1.0f / scene.nWidth, 1.0f / scene.nHeight };
+	const GLfloat fHalf[2] = { 1.0f / edge.nWidth, 1.0f / edge.nHeight };
+	const unsigned int nPrograms[] = { PROGRAM_EDGE, PROGRAM_EDGE_HALF };
+
+	for( unsigned int i = 0; i < sizeof( nPrograms ) / sizeof( nPrograms[0] ); ++i )
+	{
+		const GLfloat * pSize = nPrograms[i] == PROGRAM_EDGE_HALF ? fHalf : fFull;
+
+		if( GetProgram( nPrograms[i] ) )
+		{
+			glUseProgram( GetProgram( nPrograms[i] ) );
+			glUniform2f( GetUniform( nPrograms[i], UNIFORM_TEXEL_SIZE ), pSize[0], pSize[1] );
+			glUniform2f( GetUniform( nPrograms[i], UNIFORM_TEX_MAX ), (width - 0.5f) * fFull[0], (height - 0.5f) * fFull[1] );
+		}
+	}
+
+	glUseProgram( 0 );
+}
+
+GLvoid ReSizeGLScene( GLsizei width, GLsizei height )
+{
+	if ( height == 0 )
+	{
+		height = 1;
+	}
+
+	if ( width == 0 )
+	{
+		width = 1;
+	}
+
+	// Framebuffers and textures are only reallocated when the size bucket changes
+	ResizeRenderTargets( width, height );
+	SetEdgeUniforms( width, height );
+
+	g_nViewWidth  = width;
+	g_nViewHeight = height;
+	glViewport( 0, 0, width, height );
+	glScissor( 0, 0, width, height );
+
+	glMatrixMode( GL_PROJECTION );
+	glLoadIdentity();
+
+	g_fViewAspect = (GLfloat) width / (GLfloat) height;
+	gluPerspective( CAMERA_FOV, g_fViewAspect, 0.1f, 10.0f );
+
+	glMatrixMode( GL_MODELVIEW );
+	glLoadIdentity();
+}
+
+///***********************************************************///
+#endif
+
+///***********************************************************///
+/// World initialization
+///***********************************************************///
+
+void CameraPositionSync( cpBody* body, cpFloat dt )
+{
+	// Sync to player character
+	VehicleData * pPcVehicle = PoolGet( g_Vehicles, g_hPcVehicle );
+	if( pPcVehicle )
+		body->p = pPcVehicle->chassis->body->p;
+}
+
+// Free all entities, the pools keep their memory for the next level
+void ResetArrays( void )
+{
+	PoolReset( g_Vehicles );
+	PoolReset( g_Wheels );
+	PoolReset( g_Rocks );
+
+	g_hPcVehicle = HANDLE_NONE;
+}
+
+void AllocArrays( void )
+{
+	ResetArrays();
+}
+
+void FreeArrays( void )
+{
+	PoolDestroy( g_Vehicles );
+	PoolDestroy( g_Wheels );
+	PoolDestroy( g_Rocks );
+}
+
+// Remove the constraints that link a vehicle to the vehicle towing it
+void ReleaseLink( cpSpace * space, VehicleData * pVehicleData )
+{
+	RemoveConstraint( space, &pVehicleData->link );
+	RemoveConstraint( space, &pVehicleData->linkLimit );
+	RemoveConstraint( space, &pVehicleData->linkGroove );
+
+	pVehicleData->linkVehicle = HANDLE_NONE;
+}
+
+// Remove a rock from the physics space and free its slot
+void ReleaseRock( cpSpace * space, Handle hRock )
+{
+	RockData * pRockData = PoolGet( g_Rocks, hRock );
+
+	if( pRockData )
+	{
+		WakeRock( pRockData );
+		RemoveBody( space, pRockData->rock, NULL );
+		PoolFree( g_Rocks, hRock );
+	}
+}
+
+// Remove a wheel and its constraints from the physics space and free its slot
+void ReleaseWheel( cpSpace * space, Handle hWheel )
+{
+	int i;
+	WheelData * pWheelData = PoolGet( g_Wheels, hWheel );
+
+	if( pWheelData )
+	{
+		RemoveConstraint( space, &pWheelData->spring );
+		RemoveConstraint( space, &pWheelData->joint );
+
+		VehicleData * pVehicleData = PoolGet( g_Vehicles, pWheelData->vehicle );
+		if( pVehicleData )
+		{
+			for( i = 0 ; i < MAX_VEHICLE_WHEELS ; ++i )
+			{
+				if( pVehicleData->wheel[i] == hWheel )
+					pVehicleData->wheel[i] = HANDLE_NONE;
+			}
+		}
+
+		RemoveBody( space, pWheelData->wheel, NULL );
+		PoolFree( g_Wheels, hWheel );
+	}
+}
+
+// Remove a vehicle, its wheels and its constraints from the physics space and free their slots
+void ReleaseVehicle( cpSpace * space, Handle hVehicle )
+{
+	unsigned int i;
+	VehicleData * pVehicleData = PoolGet( g_Vehicles, hVehicle );
+
+	if( pVehicleData )
+	{
+		WakeVehicle( pVehicleData );
+
+		for( i = 0 ; i < MAX_VEHICLE_WHEELS ; ++i )
+		{
+			ReleaseWheel( space, pVehicleData->wheel[i] );
+		}
+
+		ReleaseLink( space, pVehicleData );
+
+		// Unlink vehicles towed by this one
+		for( i = 0 ; i < g_Vehicles.nSlots ; ++i )
+		{
+			if( PoolIsLive( g_Vehicles, i ) && g_Vehicles.pData[i].linkVehicle == hVehicle )
+				ReleaseLink( space, &g_Vehicles.pData[i] );
+		}
+
+		RemoveBody( space, pVehicleData->chassis, NULL );
+		PoolFree( g_Vehicles, hVehicle );
+	}
+}
+
+// Post step callbacks, release entities that fell out of the world
+static void ReleaseRockCallback( cpSpace *space, void *obj, void *data )
+{
+	ReleaseRock( space, (Handle)(size_t) data );
+}
+
+static void ReleaseVehicleCallback( cpSpace *space, void *obj, void *data )
+{
+	ReleaseVehicle( space, (Handle)(size_t) data );
+}
+
+static void ReleaseWheelCallback( cpSpace *space, void *obj, void *data )
+{
+	ReleaseWheel( space, (Handle)(size_t) data );
+}
+
+// Queue the release of anything reaching the bottom boundary. Callbacks get the
+// handle rather than the shape, so an entity released twice in a step is ignored.
+static int FallOutHandler( cpArbiter* pArbiter, struct cpSpace* pSpace, void* pData )
+{
+	CP_ARBITER_GET_SHAPES( pArbiter, a, b );
+
+	switch( a->collision_type )
+	{
+		case T_ROCK:
+			cpSpaceAddPostStepCallback( pSpace, ReleaseRockCallback, a, a->data );
+			break;
+		case T_CHASSIS:
+			cpSpaceAddPostStepCallback( pSpace, ReleaseVehicleCallback, a, a->data );
+			break;
+		case T_WHEEL:
+		case T_WHEEL_TRAILER:
+			cpSpaceAddPostStepCallback( pSpace, ReleaseWheelCallback, a, a->data );
+			break;
+		default:
+			break;
+	}
+
+	return FALSE;
+}
+
+const TerrainLayerData terrainLayers[COUNT_TERRAIN_LAYERS] =
+{
+	{ 0.0f, 0.5f, -1.0f,  0.0f, T_ROAD,     false },	// Road
+	{ 1.5f, 1.8f, -1.5f, -1.0f, T_MOUNTAIN, true  },	// Mountains
+};
+
+// Terrain heightfield kernel, heights and normals of a layer for many vertices at once. The SSE
+// path and the scalar fallback do the same float operations in the same order, so the heights the
+// physics sees do not depend on the instruction set
+#define TERRAIN_PI				3.14159265f
+#define TERRAIN_HALF_PI			1.57079633f
+#define TERRAIN_TWO_PI			6.28318531f
+#define TERRAIN_INV_TWO_PI		0.159154943f
+
+bool g_bTerrainSimd = true;		// Benchmark switches to the scalar path
+
+// Sine for x > -pi, reduced to [-pi/2, pi/2] and a degree 9 polynomial
+inline float TerrainSin( float x )
+{
+	x = x - float( int( x * TERRAIN_INV_TWO_PI + 0.5f ) ) * TERRAIN_TWO_PI;
+	x = x > TERRAIN_HALF_PI ? TERRAIN_PI - x : x;
+	x = x < -TERRAIN_HALF_PI ? -TERRAIN_PI - x : x;
+
+	const float x2 = x * x;
+	return x * (1.0f + x2 * (-1.66666667e-1f + x2 * (8.33333333e-3f + x2 * (-1.98412698e-4f + x2 * 2.75573192e-6f))));
+}
+
+// Height of a terrain layer at a vertex
+inline float TerrainSample( const TerrainLayerData & layer, int i )
+{
+	const float p = float( i ) * float( TERRAIN_FREQUENCY );
+
+	return layer.fBase + TerrainSin( p * layer.fPeriod ) * TerrainSin( p * (layer.fPeriod * 0.1f) + TERRAIN_HALF_PI );
+}
+
+#ifdef TERRAIN_SSE
+inline __m128 TerrainSin4( __m128 x )
+{
+	const __m128 halfPi = _mm_set1_ps( TERRAIN_HALF_PI );
+	const __m128 pi = _mm_set1_ps( TERRAIN_PI );
+
+	x = _mm_sub_ps( x, _mm_mul_ps( _mm_cvtepi32_ps( _mm_cvttps_epi32( _mm_add_ps( _mm_mul_ps( x, _mm_set1_ps( TERRAIN_INV_TWO_PI ) ), _mm_set1_ps( 0.5f ) ) ) ), _mm_set1_ps( TERRAIN_TWO_PI ) ) );
+
+	__m128 mask = _mm_cmpgt_ps( x, halfPi );
+	x = _mm_or_ps( _mm_and_ps( mask, _mm_sub_ps( pi, x ) ), _mm_andnot_ps( mask, x ) );
+	mask = _mm_cmplt_ps( x, _mm_sub_ps( _mm_setzero_ps(), halfPi ) );
+	x = _mm_or_ps( _mm_and_ps( mask, _mm_sub_ps( _mm_sub_ps( _mm_setzero_ps(), pi ), x ) ), _mm_andnot_ps( mask, x ) );
+
+	const __m128 x2 = _mm_mul_ps( x, x );
+	__m128 r = _mm_mul_ps( x2, _mm_set1_ps( 2.75573192e-6f ) );
+	r = _mm_mul_ps( x2, _mm_add_ps( _mm_set1_ps( -1.98412698e-4f ), r ) );
+	r = _mm_mul_ps( x2, _mm_add_ps( _mm_set1_ps( 8.33333333e-3f ), r ) );
+	r = _mm_mul_ps( x2, _mm_add_ps( _mm_set1_ps( -1.66666667e-1f ), r ) );
+	return _mm_mul_ps( x, _mm_add_ps( _mm_set1_ps( 1.0f ), r ) );
+}
+#endif
+
+// Heights of nCount vertices of a layer, starting at vertex nFirst
+void EvaluateTerrainY( unsigned int nLayer, int nFirst, int nCount, float * pY )
+{
+	const TerrainLayerData & layer = terrainLayers[nLayer];
+	int i = 0;
+
+#ifdef TERRAIN_SSE
+	if( g_bTerrainSimd )
+	{
+		const __m128 base = _mm_set1_ps( layer.fBase );
+		const __m128 period = _mm_set1_ps( layer.fPeriod );
+		const __m128 periodLow = _mm_set1_ps( layer.fPeriod * 0.1f );
+		const __m128 frequency = _mm_set1_ps( float( TERRAIN_FREQUENCY ) );
+		const __m128 halfPi = _mm_set1_ps( TERRAIN_HALF_PI );
+
+		for( ; i + 4 <= nCount; i += 4 )
+		{
+			const __m128i index = _mm_add_epi32( _mm_set1_epi32( nFirst + i ), _mm_set_epi32( 3, 2, 1, 0 ) );
+			const __m128 p = _mm_mul_ps( _mm_cvtepi32_ps( index ), frequency );
+			const __m128 y = _mm_mul_ps( TerrainSin4( _mm_mul_ps( p, period ) ), TerrainSin4( _mm_add_ps( _mm_mul_ps( p, periodLow ), halfPi ) ) );
+
+			_mm_storeu_ps( &pY[i], _mm_add_ps( base, y ) );
+		}
+	}
+#endif
+
+	for( ; i < nCount; ++i )
+	{
+		pY[i] = TerrainSample( layer, nFirst + i );
+	}
+}
+
+// Normals of the top strip at nCount vertices from central differences, pY holds nCount + 2 heights
+// starting one vertex before the first
+void EvaluateTerrainNormals( const float * pY, int nCount, float fStep, float * pNX, float * pNY )
+{
+	int i = 0;
+
+#ifdef TERRAIN_SSE
+	if( g_bTerrainSimd )
+	{
+		const __m128 dx = _mm_set1_ps( 2.0f * fStep );
+
+		for( ; i + 4 <= nCount; i += 4 )
+		{
+			const __m128 dy = _mm_sub_ps( _mm_loadu_ps( &pY[i] ), _mm_loadu_ps( &pY[i + 2] ) );
+			const __m128 length = _mm_sqrt_ps( _mm_add_ps( _mm_mul_ps( dy, dy ), _mm_mul_ps( dx, dx ) ) );
+
+			_mm_storeu_ps( &pNX[i], _mm_div_ps( dy, length ) );
+			_mm_storeu_ps( &pNY[i], _mm_div_ps( dx, length ) );
+		}
+	}
+#endif
+
+	for( ; i < nCount; ++i )
+	{
+		const float dy = pY[i] - pY[i + 2];
+		const float dx = 2.0f * fStep;
+		const float length = sqrtf( dy * dy + dx * dx );
+
+		pNX[i] = dy / length;
+		pNY[i] = dx / length;
+	}
+}
+
+// Height and angle of a terrain layer at a vertex, computed on demand so nothing is stored per level
+HeightData GetTerrainHeight( unsigned int nLayer, int i )
+{
+	const TerrainLayerData & layer = terrainLayers[nLayer];
+	HeightData height;
+
+	height.y = TerrainSample( layer, i );
+	height.a = (i > 0 ? atan( (TerrainSample( layer, i - 1 ) - height.y) / g_fTerrainStep ) : 0);
+
+	return height;
+}
+
+inline bool IsInTerrainChunk( const TerrainChunk & chunk, cpFloat x )
+{
+	return chunk.nChunk >= 0 && x >= chunk.nFirst * g_fTerrainStep && x <= chunk.nLast * g_fTerrainStep;
+}
+
+inline void SetTerrainVertex( VertexData & v, float x, float y, float z, float nx, float ny, float nz, float t )
+{
+	v.x = x; v.y = y; v.z = z;
+	v.nx = nx; v.ny = ny; v.nz = nz;
+	v.s = x; v.t = t;
+}
+
+// Compute the vertices and segment points of a chunk, called by workers and the main thread
+void GenerateTerrainChunk( TerrainJob & job )
+{
+	unsigned int nLayer;
+	int i, nCount;
+	float y[TERRAIN_CHUNK_SEGMENTS + 3];
+#ifndef HEADLESS
+	float nx[TERRAIN_CHUNK_SEGMENTS + 1], ny[TERRAIN_CHUNK_SEGMENTS + 1];
+#endif
+
+	job.nFirst = job.nChunk * TERRAIN_CHUNK_SEGMENTS;
+	job.nLast  = job.nFirst + TERRAIN_CHUNK_SEGMENTS;
+	job.nLast  = job.nLast > LEVEL_RIGHT ? LEVEL_RIGHT : job.nLast;
+	nCount = job.nLast - job.nFirst + 1;
+
+	for( nLayer = 0; nLayer < COUNT_TERRAIN_LAYERS; ++nLayer )
+	{
+		// One vertex either side for the normals
+		EvaluateTerrainY( nLayer, job.nFirst - 1, nCount + 2, y );
+#ifndef HEADLESS
+		EvaluateTerrainNormals( y, nCount, g_fTerrainStep, nx, ny );
+#endif
+
+		for( i = 0; i < nCount; ++i )
+		{
+			cpVect v = cpv( (job.nFirst + i) * g_fTerrainStep, y[i + 1] );
+			job.points[nLayer][i] = v;
+
+#ifndef HEADLESS
+			const TerrainLayerData & layer = terrainLayers[nLayer];
+			VertexData * pFront = &job.front[nLayer][i * 2];
+			VertexData * pTop = &job.top[nLayer][i * 2];
+
+			SetTerrainVertex( pFront[0], v.x, layer.fFrontY, layer.fFrontZ, 0.0f, 0.0f, 1.0f, 0.0f );
+			SetTerrainVertex( pFront[1], v.x, v.y, 0.0f, 0.0f, 0.0f, 1.0f, 1.0f );
+			SetTerrainVertex( pTop[0],   v.x, v.y, 0.0f, nx[i], ny[i], 0.0f, 0.0f );
+			SetTerrainVertex( pTop[1],   v.x, v.y, -1.0f, nx[i], ny[i], 0.0f, 1.0f );
+#endif
+		}
+	}
+}
+
+// Terrain worker, generates queued chunks until the workers are stopped
+ThreadResult THREAD_CALL TerrainWorker( void * pData )
+{
+	LockMutex( g_TerrainMutex );
+
+	while( !g_bTerrainQuit )
+	{
+		TerrainJob * pJob = NULL;
+
+		for( unsigned int i = 0; i < TERRAIN_MAX_JOBS && !pJob; ++i )
+		{
+			if( g_TerrainJobs[i].nState == JOB_QUEUED )
+				pJob = &g_TerrainJobs[i];
+		}
+
+		if( !pJob )
+		{
+			WaitCondition( g_TerrainCondition, g_TerrainMutex );
+			continue;
+		}
+
+		pJob->nState = JOB_BUSY;
+		UnlockMutex( g_TerrainMutex );
+
+		GenerateTerrainChunk( *pJob );
+
+		LockMutex( g_TerrainMutex );
+		pJob->nState = JOB_DONE;
+		WakeCondition( g_TerrainCondition );
+	}
+
+	UnlockMutex( g_TerrainMutex );
+
+	return 0;
+}
+
+void StartTerrainWorkers( void )
+{
+	unsigned int i;
+
+	for( i = 0; i < TERRAIN_MAX_JOBS; ++i )
+	{
+		g_TerrainJobs[i].nChunk = -1;
+		g_TerrainJobs[i].nState = JOB_FREE;
+	}
+
+	g_bTerrainQuit = false;
+	InitMutex( g_TerrainMutex );
+	InitCondition( g_TerrainCondition );
+
+	for( i = 0; i < TERRAIN_WORKERS; ++i )
+	{
+		CreateWorkerThread( g_TerrainWorkers[i], TerrainWorker, NULL );
+	}
+}
+
+void StopTerrainWorkers( void )
+{
+	unsigned int i;
+
+	LockMutex( g_TerrainMutex );
+	g_bTerrainQuit = true;
+	WakeCondition( g_TerrainCondition );
+	UnlockMutex( g_TerrainMutex );
+
+	for( i = 0; i < TERRAIN_WORKERS; ++i )
+	{
+		JoinWorkerThread( g_TerrainWorkers[i] );
+	}
+
+	DestroyCondition( g_TerrainCondition );
+	DestroyMutex( g_TerrainMutex );
+}
+
+// Queue a chunk for the workers, unless it is queued already or no job is free
+void QueueTerrainChunk( int nChunk )
+{
+	TerrainJob * pFree = NULL;
+
+	for( unsigned int i = 0; i < TERRAIN_MAX_JOBS; ++i )
+	{
+		if( g_TerrainJobs[i].nChunk == nChunk )
+			return;
+
+		if( !pFree && g_TerrainJobs[i].nState == JOB_FREE )
+			pFree = &g_TerrainJobs[i];
+	}
+
+	if( pFree )
+	{
+		pFree->nChunk = nChunk;
+		pFree->nState = JOB_QUEUED;
+		WakeCondition( g_TerrainCondition );
+	}
+}
+
+// Get the generated chunk, generate it on this thread if no worker started on it yet
+// or wait for the worker that did
+TerrainJob * AcquireTerrainChunk( int nChunk )
+{
+	TerrainJob * pJob = NULL;
+	bool bGenerate = false;
+
+	LockMutex( g_TerrainMutex );
+
+	for( unsigned int i = 0; i < TERRAIN_MAX_JOBS && !pJob; ++i )
+	{
+		if( g_TerrainJobs[i].nChunk == nChunk )
+			pJob = &g_TerrainJobs[i];
+	}
+
+	if( pJob && pJob->nState == JOB_QUEUED )
+	{
+		pJob->nState = JOB_BUSY;
+		bGenerate = true;
+	}
+	else
+	{
+		while( pJob && pJob->nState == JOB_BUSY )
+		{
+			WaitCondition( g_TerrainCondition, g_TerrainMutex );
+		}
+	}
+
+	UnlockMutex( g_TerrainMutex );
+
+	if( !pJob )
+	{
+		pJob = &g_TerrainLocalJob;
+		pJob->nChunk = nChunk;
+		bGenerate = true;
+	}
+
+	if( bGenerate )
+	{
+		GenerateTerrainChunk( *pJob );
+	}
+
+	return pJob;
+}
+
+void ReleaseTerrainJob( TerrainJob * pJob )
+{
+	LockMutex( g_TerrainMutex );
+	pJob->nChunk = -1;
+	pJob->nState = JOB_FREE;
+	UnlockMutex( g_TerrainMutex );
+}
+
+// Upload the strips of a generated chunk and add its segments to the static hash
+void LoadTerrainChunk( TerrainChunk & chunk, const TerrainJob & job )
+{
+	cpShape* shape;
+	unsigned int nLayer, i;
+
+	chunk.nChunk = job.nChunk;
+	chunk.nFirst = job.nFirst;
+	chunk.nLast  = job.nLast;
+	chunk.nShapes = 0;
+
+	for( nLayer = 0; nLayer < COUNT_TERRAIN_LAYERS; ++nLayer )
+	{
+		const TerrainLayerData & layer = terrainLayers[nLayer];
+
+		// The segment to the first vertex belongs to the chunk before
+		for( i = 1; i <= (unsigned int) (job.nLast - job.nFirst); ++i )
+		{
+			shape = cpSegmentShapeNew( bounds, job.points[nLayer][i - 1], job.points[nLayer][i], 0.0f );
+			shape->e = 0.0f; shape->u = 1.0f;
+			shape->sensor = layer.bSensor;
+			shape->collision_type = layer.collisionType;
+			if( nLayer == TERRAIN_ROAD )
+				shape->layers = LAYER_DEFAULT;
+			chunk.shapes[chunk.nShapes++] = cpSpaceAddStaticShape( space, shape );
+		}
+
+#ifndef HEADLESS
+		glBindBuffer( GL_ARRAY_BUFFER, chunk.buffers[nLayer * 2] );
+		glBufferData( GL_ARRAY_BUFFER, (job.nLast - job.nFirst + 1) * sizeof( VertexData ) * 2, job.front[nLayer], GL_STATIC_DRAW );
+
+		glBindBuffer( GL_ARRAY_BUFFER, chunk.buffers[nLayer * 2 + 1] );
+		glBufferData( GL_ARRAY_BUFFER, (job.nLast - job.nFirst + 1) * sizeof( VertexData ) * 2, job.top[nLayer], GL_STATIC_DRAW );
+#endif
+	}
+
+	// Bottom boundary, anything reaching it is removed from the world
+	shape = cpSegmentShapeNew( bounds, cpv( chunk.nFirst * g_fTerrainStep, -5.0f ), cpv( chunk.nLast * g_fTerrainStep, -5.0f ), 0.5f );
+	shape->collision_type = T_BOTTOM_BOUNDARY;
+	shape->sensor = TRUE;
+	chunk.shapes[chunk.nShapes++] = cpSpaceAddStaticShape( space, shape );
+
+	// Whatever was held in place waiting for this chunk may fall now
+	for( i = 0; i < g_Vehicles.nSlots; ++i )
+	{
+		if( PoolIsLive( g_Vehicles, i ) && IsInTerrainChunk( chunk, g_Vehicles.pData[i].chassis->body->p.x ) )
+			WakeVehicle( &g_Vehicles.pData[i] );
+	}
+
+	for( i = 0; i < g_Rocks.nSlots; ++i )
+	{
+		if( PoolIsLive( g_Rocks, i ) && IsInTerrainChunk( chunk, g_Rocks.pData[i].rock->body->p.x ) )
+			WakeRock( &g_Rocks.pData[i] );
+	}
+}
+
+// Remove the segments of a chunk, its buffers are reused by the next chunk in the slot
+void UnloadTerrainChunk( TerrainChunk & chunk )
+{
+	for( unsigned int i = 0; i < chunk.nShapes; ++i )
+	{
+		cpSpaceRemoveStaticShape( space, chunk.shapes[i] );
+		cpShapeFree( chunk.shapes[i] );
+	}
+
+	chunk.nShapes = 0;
+	chunk.nChunk = -1;
+}
+
+// Forget all chunks, call when their shapes are freed along with the space
+void ResetTerrain( void )
+{
+	for( unsigned int i = 0; i < TERRAIN_MAX_CHUNKS; ++i )
+	{
+		g_TerrainChunks[i].nChunk = -1;
+		g_TerrainChunks[i].nShapes = 0;
+	}
+}
+
+// Chunks within streaming distance of a part of the level
+void GetTerrainChunkRange( cpFloat xLeft, cpFloat xRight, int & nMin, int & nMax )
+{
+	const cpFloat chunkWidth = TERRAIN_CHUNK_SEGMENTS * g_fTerrainStep;
+	const int nLastChunk = (LEVEL_RIGHT - 1) / TERRAIN_CHUNK_SEGMENTS;
+
+	nMin = int( floor( (xLeft - TERRAIN_STREAM_DISTANCE) / chunkWidth ) );
+	nMax = int( floor( (xRight + TERRAIN_STREAM_DISTANCE) / chunkWidth ) );
+
+	nMin = nMin < 0 ? 0 : nMin;
+	nMax = nMax > nLastChunk ? nLastChunk : nMax;
+
+	// Keep the chunks ahead when the range does not fit
+	if( nMax - nMin + 1 > TERRAIN_MAX_CHUNKS )
+	{
+		nMin = nMax - TERRAIN_MAX_CHUNKS + 1;
+	}
+}
+
+bool IsTerrainChunkLoaded( int nChunk )
+{
+	for( unsigned int i = 0; i < TERRAIN_MAX_CHUNKS; ++i )
+	{
+		if( g_TerrainChunks[i].nChunk == nChunk )
+			return true;
+	}
+
+	return false;
+}
+
+// Load the chunks covering a part of the level and unload all others. Which chunks are loaded
+// only depends on the physics state, workers just get them ready in advance.
+void StreamTerrain( cpFloat xLeft, cpFloat xRight )
+{
+	const cpFloat xStart = LEVEL_START * g_fTerrainStep;
+	int nMin, nMax, nStartMin, nStartMax, n;
+	unsigned int i;
+
+	GetTerrainChunkRange( xLeft, xRight, nMin, nMax );
+
+	for( i = 0; i < TERRAIN_MAX_CHUNKS; ++i )
+	{
+		TerrainChunk & chunk = g_TerrainChunks[i];
+
+		if( chunk.nChunk >= 0 && (chunk.nChunk < nMin || chunk.nChunk > nMax) )
+			UnloadTerrainChunk( chunk );
+	}
+
+	for( n = nMin; n <= nMax; ++n )
+	{
+		if( IsTerrainChunkLoaded( n ) )
+			continue;
+
+		for( i = 0; i < TERRAIN_MAX_CHUNKS && g_TerrainChunks[i].nChunk >= 0; ++i );
+
+		if( i < TERRAIN_MAX_CHUNKS )
+		{
+			TerrainJob * pJob = AcquireTerrainChunk( n );
+
+			LoadTerrainChunk( g_TerrainChunks[i], *pJob );
+
+			if( pJob != &g_TerrainLocalJob )
+				ReleaseTerrainJob( pJob );
+		}
+	}
+
+	// Prefetch the chunks ahead and behind, and those of the level start for the next level
+	GetTerrainChunkRange( xStart, xStart, nStartMin, nStartMax );
+
+	LockMutex( g_TerrainMutex );
+
+	for( i = 0; i < TERRAIN_MAX_JOBS; ++i )
+	{
+		TerrainJob & job = g_TerrainJobs[i];
+
+		if( job.nState != JOB_BUSY && job.nChunk >= 0 &&
+			(job.nChunk < nMin - 1 || job.nChunk > nMax + TERRAIN_PREFETCH_CHUNKS) &&
+			(job.nChunk < nStartMin || job.nChunk > nStartMax) )
+		{
+			job.nChunk = -1;
+			job.nState = JOB_FREE;
+		}
+	}
+
+	for( n = nMax + 1; n <= nMax + TERRAIN_PREFETCH_CHUNKS && n <= (LEVEL_RIGHT - 1) / TERRAIN_CHUNK_SEGMENTS; ++n )
+	{
+		QueueTerrainChunk( n );
+	}
+
+	if( nMin > 0 )
+	{
+		QueueTerrainChunk( nMin - 1 );
+	}
+
+	for( n = nStartMin; n <= nStartMax; ++n )
+	{
+		if( !IsTerrainChunkLoaded( n ) )
+			QueueTerrainChunk( n );
+	}
+
+	UnlockMutex( g_TerrainMutex );
+}
+
+// Stream the terrain around the player character vehicles, call every physics tick
+void UpdateTerrain( void )
+{
+	cpFloat xLeft = INFINITY;
+	cpFloat xRight = -INFINITY;
+
+	for( unsigned int i = 0; i < g_Vehicles.nSlots; ++i )
+	{
+		if( PoolIsLive( g_Vehicles, i ) && !g_Vehicles.pData[i].npc && !g_Vehicles.pData[i].dead )
+		{
+			cpFloat x = g_Vehicles.pData[i].chassis->body->p.x;
+
+			xLeft  = x < xLeft ? x : xLeft;
+			xRight = x > xRight ? x : xRight;
+		}
+	}
+
+	// Without a player character follow the camera
+	if( xLeft > xRight )
+	{
+		xLeft = xRight = g_Camera.pivot->body->p.x;
+	}
+
+	StreamTerrain( xLeft, xRight );
+}
+
+bool IsTerrainLoaded( cpFloat x )
+{
+	for( unsigned int i = 0; i < TERRAIN_MAX_CHUNKS; ++i )
+	{
+		if( IsInTerrainChunk( g_TerrainChunks[i], x ) )
+			return true;
+	}
+
+	return false;
+}
+
+cpShape* SpawnVehicle( const int x, unsigned char nCarType = 0, int nWheelPairs = 2, bool bNpc = true )
+{
+	cpBody*			body;
+	cpShape*		shape;
+	cpShape*		chassis;
+
+	cpBody*			wheel;
+	cpConstraint*	joint;
+	cpConstraint*	spring;
+
+	Handle			hVehicle, hWheel[MAX_VEHICLE_WHEELS];
+	VehicleData*	pVehicleData;
+	WheelData*		pWheelData;
+
+	// Make sure that wheel pairs is below the maximum for a vehicle
+	if( nWheelPairs > MAX_VEHICLE_WHEELS ) nWheelPairs = MAX_VEHICLE_WHEELS;
+
+	// Take the slots first, when a pool is full the vehicle is not spawned
+	if( (hVehicle = PoolAlloc( g_Vehicles )) == HANDLE_NONE )
+	{
+		return NULL;
+	}
+
+	for( int i = 0 ; i < nWheelPairs ; ++i )
+	{
+		if( (hWheel[i] = PoolAlloc( g_Wheels )) == HANDLE_NONE )
+		{
+			for( int j = 0 ; j < i ; ++j )
+			{
+				PoolFree( g_Wheels, hWheel[j] );
+			}
+
+			PoolFree( g_Vehicles, hVehicle );
+			return NULL;
+		}
+	}
+
+	// Get a unique group ID for this vehicle
+	int group = ( bNpc ? GROUP_NPC + g_nNpcVehicles : GROUP_PC );
+
+	cpFloat wheelMass = WORLD_SCALE;
+	cpVect offset;
+
+	cpVect verts[] = {
+		cpv(  WORLD_SCALE, -WORLD_SCALE ),
+		cpv( -WORLD_SCALE, -WORLD_SCALE ),
+		cpv( -WORLD_SCALE,  WORLD_SCALE * 0.5f ),
+		cpv(  WORLD_SCALE,  WORLD_SCALE * 0.5f )
+	};
+
+	const cpFloat fWheelRadius = WORLD_SCALE * 0.4f;
+
+	body    = cpBodyNew( WORLD_SCALE * 12.0f, cpMomentForPoly( WORLD_SCALE * 5.0f, sizeof( verts ) / sizeof( cpVect ), verts, cpvzero ) );
+	body->p = cpv( x * g_fTerrainStep, GetTerrainHeight( TERRAIN_ROAD, x ).y + WORLD_SCALE * 3.0f );
+	body->w_limit = PLAYER_W_LIMIT;
+
+	cpBodyApplyForce( body, cpv( 0.0f, WORLD_SCALE * 21.0f ), cpvzero );
+
+	if( bNpc )
+	{
+		// Non-player character vehicle
+		++g_nNpcVehicles;
+	}
+	else
+	{
+		// Player character vehicle
+		++g_nPcVehicles;
+	}
+	pVehicleData = PoolGet( g_Vehicles, hVehicle );
+
+	chassis = cpPolyShapeNew( body, sizeof( verts ) / sizeof( cpVect ), verts, cpvzero );
+	chassis->e = 0.0f; chassis->u = WORLD_SCALE * 0.5f;
+	chassis->group = group;
+	chassis->collision_type = T_CHASSIS;
+	chassis->data = HANDLE_DATA( hVehicle );
+	chassis->layers = LAYER_DEFAULT;
+	AddBody( space, chassis, NULL );
+
+	pVehicleData->carType = nCarType;
+	pVehicleData->npc = bNpc;
+	pVehicleData->chassis = chassis;
+
+	for( int i = 0 ; i < nWheelPairs ; ++i ) 
+	{
+		offset = cpv( -WORLD_SCALE + (WORLD_SCALE * ( nCarType == 0 && !bNpc ? 3 : 2 ) / float( nWheelPairs - 1 )) * i, -WORLD_SCALE * 1.2f );
+
+		wheel = cpBodyNew( wheelMass, cpMomentForCircle( wheelMass, 0.0, fWheelRadius, cpvzero ) );
+		wheel->p = cpvadd( body->p, offset );
+		wheel->v = body->v;
+
+		shape = cpCircleShapeNew( wheel, fWheelRadius, cpvzero );
+		shape->e = 0.0;
+		shape->u = 2.5;
+		
+		if( nCarType == 0 )
+		{
+			shape->collision_type = T_WHEEL;
+		}
+		else
+		{
+			shape->collision_type = T_WHEEL_TRAILER;
+		}
+
+		shape->group = group;
+		shape->data = HANDLE_DATA( hWheel[i] );
+		shape->layers = LAYER_DEFAULT;
+		AddBody( space, shape, NULL );
+
+		// Create a joint that holds the wheel
+		joint = cpPinJointNew( body, wheel, cpvzero, cpvzero );
+		cpSpaceAddConstraint( space, joint );
+
+		// Create a spring for wheel suspension
+		spring = cpDampedSpringNew( body, wheel, cpv( offset.x, offset.y ), cpvzero, 0.0f, 300.0f, WORLD_SCALE );
+		cpSpaceAddConstraint( space, spring );
+
+		pVehicleData->wheel[i] = hWheel[i];
+
+		pWheelData = PoolGet( g_Wheels, hWheel[i] );
+		pWheelData->vehicle = hVehicle;
+		pWheelData->attached = true;
+		pWheelData->joint = joint;
+		pWheelData->spring = spring;
+		pWheelData->wheel = shape;
+	}
+
+	cpBodySetAngle( body, -GetTerrainHeight( TERRAIN_ROAD, x ).a );
+
+	return chassis;
+}
+
+// Creates a new rock and adds it to the physics space
+void SpawnRock()
+{
+	cpBody*  body;
+	cpShape* shape;
+
+	Handle    hRock;
+	RockData* pRockData;
+
+	const cpFloat radius = 0.1f + float( _rand() % 20 ) / 25.0f * 0.4f;
+	const cpFloat mass   = radius * WORLD_SCALE * 75.0f;
+
+	int x = _rand() % TERRAIN_SEGMENTS;
+
+	// No rock when the pool is full
+	if( (hRock = PoolAlloc( g_Rocks )) == HANDLE_NONE )
+	{
+		return;
+	}
+
+	body       = cpBodyNew( mass, cpMomentForCircle( mass, 0.0f, radius, cpvzero ) );
+	body->p    = cpv( x * g_fTerrainStep, GetTerrainHeight( TERRAIN_ROAD, x ).y + WORLD_SCALE * 3.0f + radius );
+
+	pRockData = PoolGet( g_Rocks, hRock );
+	shape    = cpCircleShapeNew( body, radius, cpvzero );
+	shape->e = 0.05f; shape->u = 0.1f;
+	shape->data = HANDLE_DATA( hRock );
+	shape->collision_type = T_ROCK;
+	shape->layers = LAYER_DEFAULT;
+	AddBody( space, shape, NULL );
+
+	pRockData->rock = shape;
+}
+
+void StartLevel()
+{
+	cpShape* shape;
+	Handle hLast;
+
+	cpBody* body;
+	cpBody* bodyLast;
+
+	int f = 0 + 10;
+
+	ResetArrays();
+
+	// Load the terrain around the player character before anything is spawned
+	StreamTerrain( LEVEL_START * g_fTerrainStep, LEVEL_START * g_fTerrainStep );
+
+	// Spawn player character vehicle (car), the pools were just emptied so it always fits
+	shape = SpawnVehicle( f + 2, 0, COUNT_WHEELS_CAR, false );
+	g_hPcVehicle = hLast = SHAPE_HANDLE( shape );
+	body = bodyLast = shape->body;
+	
+	// Spawn player character vehicles (trailers)
+	for( int i = 0; i < g_nLevel; ++i )
+	{
+		shape = SpawnVehicle( f - i * 2, 1, COUNT_WHEELS_TRAILER, false );
+		if( !shape )
+			break;
+
+		body = shape->body;
+
+		VehicleData * pVehicleData = PoolGet( g_Vehicles, SHAPE_HANDLE( shape ) );
+		pVehicleData->linkVehicle = hLast;
+		pVehicleData->link       = cpSpaceAddConstraint( space, cpDampedSpringNew( body, bodyLast, cpvzero, cpvzero, bodyLast->p.x - body->p.x, 600.0f, 1.0f ) );
+		pVehicleData->linkLimit  = cpSpaceAddConstraint( space, cpRotaryLimitJointNew( body, bodyLast, -5.0f * (M_PI / 180), 5.0f * (M_PI / 180) ) );
+		pVehicleData->linkGroove = cpSpaceAddConstraint( space, cpGrooveJointNew( bodyLast, body, cpv( -WORLD_SCALE * 10, 0 ), cpvzero, cpvzero ) );
+
+		bodyLast = body;
+		hLast = SHAPE_HANDLE( shape );
+	}
+
+	float c = (TERRAIN_SEGMENTS - 2 * f) / (g_nLevel * 2);
+
+	// Spawn non-player character vehicles
+	for( int i = 0; i < (g_nLevel * 2); ++i )
+	{
+		f += c;
+		SpawnVehicle( f, 0 );
+	}
+
+	// Spawn rocks, seeded per level so replays spawn the same rocks
+	_srand( random( g_nWorldSeed + g_nLevel ) );
+	for( int i = 0 ; i < (g_nLevel * 3) ; ++i )
+	{
+		SpawnRock();
+	}
+
+	// Size the active hash to the shapes of this level
+	ResizeHash( space->activeShapes );
+}
+
+static void NewSpace( cpSpace *space, cpShape *shape, void *data )
+{
+	unsigned int i;
+
+	// Removes the rocks
+	for( i = 0 ; i < g_Rocks.nSlots ; ++i )
+	{
+		if( PoolIsLive( g_Rocks, i ) )
+			ReleaseRock( space, PoolHandle( g_Rocks, i ) );
+	}
+
+	// Removes the vehicles
+	for( i = 0 ; i < g_Vehicles.nSlots ; ++i )
+	{
+		if( PoolIsLive( g_Vehicles, i ) )
+			ReleaseVehicle( space, PoolHandle( g_Vehicles, i ) );
+	}
+
+	++g_nLevel;
+
+	// Bodies were freed, do not interpolate from their states
+	g_nBodyStates = 0;
+
+	StartLevel();
+}
+
+static int NewLevel( cpArbiter* pArbiter, struct cpSpace* pSpace, void* pData )
+{    
+	cpSpaceAddPostStepCallback( space, (cpPostStepFunc) NewSpace, NULL, NULL );
 
     return FALSE;
 }
 
-// Initialize globals
-void InitGlobals( void )
+// Initialize globals
+void InitGlobals( void )
+{
+	// Initialize global variables
+	g_nNpcVehicles = 0;
+	g_nPcVehicles = 0;
+	g_fBoost = 0;
+	g_bKeyLock = false;
+	g_bActiveWindow = true;
+	g_nScore = 0;
+	g_fMultiplier = 1.0f;
+	g_nLastScoreTick = 0;
+	g_nPhysicsTick = 0;
+	g_nLevel = 1;
+	g_nWorldSeed = (unsigned int) (GetTime() * 1000.0);
+}
+
+// Destroys the physics space
+void DestroyWorld( void )
+{
+	if( space )
+	{
+		// Sleeping bodies and constraints are not in the space and would not be freed with it
+		WakeAllBodies();
+	}
+
+	FreeArrays();
+
+	if( space )
+	{
+		StopTerrainWorkers();
+
+		cpSpaceFreeChildren( space );
+		cpSpaceFree( space );
+		cpBodyFree( bounds );
+		space = NULL;
+		bounds = NULL;
+	}
+
+	// Terrain shapes were freed with the space
+	ResetTerrain();
+
+	delete[] g_pBodyStates;
+	g_pBodyStates = NULL;
+	g_nBodyStates = g_nMaxBodyStates = 0;
+}
+
+// Initialize the physics space
+void InitWorld( void )
+{
+	cpBody* body;
+	cpShape* shape;
+	cpConstraint* constraint;
+
+	AllocArrays();
+
+	//Clear and create a new space
+	cpResetShapeIdCounter();
+	space = cpSpaceNew();
+	space->iterations = 20;
+	space->gravity = cpv(0, -5.0f);
+
+	bounds = cpBodyNew( INFINITY, INFINITY );
+	bounds->p = cpv( 0.0f, 0.0f );
+
+	g_fTerrainStep = float( TERRAIN_WIDTH ) / float( TERRAIN_SEGMENTS );
+
+	// Terrain is loaded in chunks around the camera
+	ResetTerrain();
+	StartTerrainWorkers();
+
+	// Add camera physics to world
+	body = cpBodyNew( 10.0f, cpMomentForCircle( 10.0f, 0.0, WORLD_SCALE, cpvzero ) );
+	body->p = cpv( 0, 0 );
+	body->v_limit = 0;
+	cpSpaceAddBody( space, body );
+
+	shape = cpCircleShapeNew( body, WORLD_SCALE, cpvzero );
+	shape->sensor = TRUE;
+	g_Camera.pivot = cpSpaceAddShape( space, shape );
+	constraint = cpGrooveJointNew( bounds, body, cpv( 0, 0 ), cpv( TERRAIN_WIDTH, 0 ), cpv( 0, 0 ) );
+
+	body = cpBodyNew( INFINITE, INFINITE );
+	body->p = cpv( 0, 0 );
+	body->v_limit = 0;
+	body->position_func = CameraPositionSync;
+	cpSpaceAddBody( space, body );
+
+	shape = cpCircleShapeNew( body, WORLD_SCALE, cpvzero );
+	shape->sensor = TRUE;
+	g_Camera.player = cpSpaceAddShape( space, shape );
+
+	// Camera constraints
+	cpSpaceAddConstraint( space, cpSlideJointNew( g_Camera.pivot->body, g_Camera.player->body, cpvzero, cpvzero, CAMERA_FOLLOW_MIN, CAMERA_FOLLOW_MAX ) );
+
+	// Left and right boundaries
+	shape = cpSegmentShapeNew( bounds, cpv( 1 * g_fTerrainStep, -5.0f ), cpv( 1* g_fTerrainStep, 10.0f ), 0.0f );
+	shape->e = 0.0f; shape->u = 10.0f;
+	shape->collision_type = T_LEFT_BOUNDARY;
+	cpSpaceAddStaticShape( space, shape );
+
+	shape = cpSegmentShapeNew( bounds, cpv( LEVEL_RIGHT * g_fTerrainStep, -5.0f ), cpv( LEVEL_RIGHT * g_fTerrainStep, 10.0f ), 0.0f );
+	shape->e = 0.0f; shape->u = 10.0f;
+	shape->collision_type = T_RIGHT_BOUNDARY;
+	cpSpaceAddStaticShape( space, shape );
+
+	shape = cpSegmentShapeNew( bounds, cpv( LEVEL_FINISH * g_fTerrainStep, -5.0f ), cpv( LEVEL_RIGHT * g_fTerrainStep, 10.0f ), 0.0f );
+	shape->e = 0.0f; shape->u = 10.0f;
+	shape->collision_type = T_FINISH;
+	shape->sensor = TRUE;
+	cpSpaceAddStaticShape( space, shape );
+
+	StartLevel();
+
+	// Size the static hash to the terrain segments once. It is not measured again as chunks
+	// stream in: the number of loaded chunks is constant and every chunk has the same number
+	// of segments of the same step, so the average bounding box hardly changes
+	ResizeHash( space->staticShapes );
+
+	// Collision handlers
+	cpSpaceAddCollisionHandler( space, T_CHASSIS, T_FINISH,			 NewLevel,				   NULL, NULL, NULL, NULL );
+	cpSpaceAddCollisionHandler( space, T_CHASSIS, T_WHEEL_TRAILER,	 KillNpcHandler,		   NULL, NULL, NULL, NULL );
+	cpSpaceAddCollisionHandler( space, T_WHEEL,   T_WHEEL_TRAILER,	 KillNpcHandler,		   NULL, NULL, NULL, NULL );
+	cpSpaceAddCollisionHandler( space, T_ROCK,    T_WHEEL_TRAILER,	 KillNpcHandler,		   NULL, NULL, NULL, NULL );
+	cpSpaceAddCollisionHandler( space, T_ROCK,          T_BOTTOM_BOUNDARY, FallOutHandler, NULL, NULL, NULL, NULL );
+	cpSpaceAddCollisionHandler( space, T_CHASSIS,       T_BOTTOM_BOUNDARY, FallOutHandler, NULL, NULL, NULL, NULL );
+	cpSpaceAddCollisionHandler( space, T_WHEEL,         T_BOTTOM_BOUNDARY, FallOutHandler, NULL, NULL, NULL, NULL );
+	cpSpaceAddCollisionHandler( space, T_WHEEL_TRAILER, T_BOTTOM_BOUNDARY, FallOutHandler, NULL, NULL, NULL, NULL );
+	cpSpaceSetDefaultCollisionHandler( space, WakeHandler, NULL, NULL, NULL, NULL );
+}
+
+///***********************************************************///
+
+#ifndef LINUX
+///***********************************************************///
+/// Window initialization
+///***********************************************************///
+
+GLvoid KillGLWindow( GLvoid )
+{
+	DestroyWorld();
+
+	if( hRC )
+	{
+		if( !wglMakeCurrent( NULL, NULL ) )
+		{
+			MessageBox( NULL, "Release Of DC And RC Failed.", "SHUTDOWN ERROR", MB_OK | MB_ICONINFORMATION );
+		}
+
+		if( !wglDeleteContext( hRC ) )
+		{
+			MessageBox( NULL, "Release Rendering Context Failed.", "SHUTDOWN ERROR", MB_OK | MB_ICONINFORMATION );
+		}
+
+		hRC = NULL;
+	}
+
+	if( hDC && !ReleaseDC( hWnd, hDC ) )
+	{
+		MessageBox( NULL, "Release Device Context Failed.", "SHUTDOWN ERROR", MB_OK | MB_ICONINFORMATION );
+		hDC = NULL;
+	}
+
+	if( hWnd && !DestroyWindow( hWnd ) )
+	{
+		MessageBox( NULL, "Could Not Release hWnd.", "SHUTDOWN ERROR", MB_OK | MB_ICONINFORMATION );
+		hWnd = NULL;
+	}
+
+	if( !UnregisterClass( "OpenGL", hInstance ) )
+	{
+		MessageBox( NULL, "Could Not Unregister Class.", "SHUTDOWN ERROR", MB_OK | MB_ICONINFORMATION );
+		hInstance = NULL;
+	}
+}
+
+int CreateGLWindow( char* title, int width, int height, int bits, bool fullscreen )
+{
+	GLuint		PixelFormat;
+	WNDCLASS	wc;		
+	DWORD		dwExStyle;
+	DWORD		dwStyle;
+	RECT		WindowRect;
+
+	WindowRect.left   = (long) 0;
+	WindowRect.right  = (long) width;
+	WindowRect.top    = (long) 0;
+	WindowRect.bottom = (long) height;
+
+	hInstance			= GetModuleHandle( NULL );
+	wc.style			= CS_HREDRAW | CS_VREDRAW | CS_OWNDC;
+	wc.lpfnWndProc		= (WNDPROC) WndProc;
+	wc.cbClsExtra		= 0;
+	wc.cbWndExtra		= 0;
+	wc.hInstance		= hInstance;
+	wc.hIcon			= LoadIcon( NULL, IDI_WINLOGO );
+	wc.hCursor			= LoadCursor( NULL, IDC_ARROW );
+	wc.hbrBackground	= NULL;
+	wc.lpszMenuName		= NULL;
+	wc.lpszClassName	= "OpenGL";
+
+	if( !RegisterClass( &wc ) )
+	{
+		MessageBox( NULL, "Failed To Register The Window Class.", "ERROR", MB_OK | MB_ICONEXCLAMATION );
+
+		return FALSE;
+	}
+
+	if( fullscreen )
+	{
+		DEVMODE dmScreenSettings;
+		ZeroMemory( &dmScreenSettings, sizeof( dmScreenSettings ) );
+
+		dmScreenSettings.dmSize			= sizeof( dmScreenSettings );
+		dmScreenSettings.dmPelsWidth	= width;
+		dmScreenSettings.dmPelsHeight	= height;
+		dmScreenSettings.dmBitsPerPel	= bits;
+		dmScreenSettings.dmFields		= DM_BITSPERPEL | DM_PELSWIDTH | DM_PELSHEIGHT;
+
+		if( ChangeDisplaySettings( &dmScreenSettings, CDS_FULLSCREEN ) != DISP_CHANGE_SUCCESSFUL )
+		{
+			if( MessageBox( NULL, "The Requested Fullscreen Mode Is Not Supported By\nYour Video Card. Use Windowed Mode Instead?", "", MB_YESNO | MB_ICONEXCLAMATION ) == IDYES )
+			{
+				fullscreen = FALSE;
+			}
+			else
+			{
+				MessageBox( NULL, "Program Will Now Close.", "ERROR", MB_OK | MB_ICONSTOP );
+
+				return FALSE;
+			}
+		}
+	}
+
+	if( fullscreen )	
+	{
+		dwExStyle = WS_EX_APPWINDOW;
+		dwStyle   = WS_POPUP;
+		ShowCursor( FALSE );
+	}
+	else
+	{
+		dwExStyle = WS_EX_APPWINDOW | WS_EX_WINDOWEDGE;
+		dwStyle   = WS_OVERLAPPEDWINDOW;
+	}
+
+	AdjustWindowRectEx( &WindowRect, dwStyle, FALSE, dwExStyle );
+
+	if( !(hWnd = CreateWindowEx( dwExStyle, 
+							    "OpenGL", 
+							    title, 
+							    dwStyle | WS_CLIPSIBLINGS | WS_CLIPCHILDREN, 
+							    0, 
+						     	0, 
+							    WindowRect.right-WindowRect.left, 
+							    WindowRect.bottom-WindowRect.top,
+							    NULL,
+							    NULL,
+							    hInstance,
+							    NULL )) )
+	{
+		KillGLWindow();
+		MessageBox( NULL, "Failed to create window", "ERROR", MB_OK | MB_ICONEXCLAMATION );
+
+		return FALSE;
+	}
+
+	static	PIXELFORMATDESCRIPTOR pfd =
+	{
+		sizeof(PIXELFORMATDESCRIPTOR),
+		1,		
+		PFD_DRAW_TO_WINDOW | PFD_SUPPORT_OPENGL | PFD_DOUBLEBUFFER,
+		PFD_TYPE_RGBA,
+		bits,
+		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 16, 0, 0,
+		PFD_MAIN_PLANE,
+		0, 0, 0, 0
+	};
+	
+	if( !(hDC = GetDC( hWnd )) )
+	{
+		KillGLWindow();
+		MessageBox( NULL, "Failed to create OpenGL DC", "ERROR", MB_OK | MB_ICONEXCLAMATION );
+
+		return FALSE;
+	}
+
+	if( !(PixelFormat = ChoosePixelFormat( hDC,&pfd )) )
+	{
+		KillGLWindow();
+		MessageBox( NULL, "Failed to choose PixelFormat", "ERROR", MB_OK | MB_ICONEXCLAMATION );
+
+		return FALSE;
+	}
+
+	if( !SetPixelFormat( hDC, PixelFormat, &pfd ) )
+	{
+		KillGLWindow();
+		MessageBox( NULL, "Failed to set PixelFormat", "ERROR",MB_OK|MB_ICONEXCLAMATION );
+
+		return FALSE;
+	}
+
+	if( !(hRC=wglCreateContext( hDC )) )
+	{
+		KillGLWindow();
+		MessageBox( NULL, "Failed to create OpenGL RC", "ERROR", MB_OK | MB_ICONEXCLAMATION );
+
+		return FALSE;
+	}
+
+	if( !wglMakeCurrent( hDC, hRC ) )
+	{
+		KillGLWindow();
+		MessageBox( NULL, "Failed to activate OpenGL RC", "ERROR", MB_OK | MB_ICONEXCLAMATION );
+		return FALSE;
+	}
+
+	if( !InitGL() )
+	{
+		KillGLWindow();
+		MessageBox( NULL, "Initialization Failed", "ERROR", MB_OK | MB_ICONEXCLAMATION );
+		return FALSE;
+	}
+
+	ShowWindow( hWnd,SW_SHOW );
+	SetForegroundWindow( hWnd );
+	SetFocus( hWnd);
+	ReSizeGLScene( width, height );
+
+	cpInitChipmunk();
+
+	InitWorld();
+
+	return TRUE;
+}
+
+void SwapGLBuffers( void )
 {
-	// Initialize global variables
-	g_nNpcVehicles = 0;
-	g_nPcVehicles = 0;
-	g_fBoost = 0;
-	g_bKeyLock = false;
+	SwapBuffers( hDC );
+}
+///***********************************************************///
+#endif
+
+#ifdef X11
+///***********************************************************///
+/// Window initialization, X11
+///***********************************************************///
+
+GLvoid KillGLWindow( GLvoid )
+{
+	DestroyWorld();
+
+	if( !g_pDisplay )
+	{
+		return;
+	}
+
+	if( g_Context )
+	{
+		glXMakeCurrent( g_pDisplay, None, NULL );
+		glXDestroyContext( g_pDisplay, g_Context );
+		g_Context = NULL;
+	}
+
+	if( g_Window )
+	{
+		XDestroyWindow( g_pDisplay, g_Window );
+		g_Window = 0;
+	}
+
+	XCloseDisplay( g_pDisplay );
+	g_pDisplay = NULL;
+}
+
+// Fullscreen is not supported, the window manager decides on the size
+int CreateGLWindow( char* title, int width, int height, int bits, bool fullscreen )
+{
+	int attributes[] = { GLX_RGBA, GLX_DOUBLEBUFFER, GLX_BUFFER_SIZE, bits, GLX_DEPTH_SIZE, 16, None };
+	XSetWindowAttributes windowAttributes;
+	XVisualInfo* pVisual;
+	Window root;
+
+	if( !(g_pDisplay = XOpenDisplay( NULL )) )
+	{
+		MessageBox( NULL, "Failed to open the X display", "ERROR", MB_OK | MB_ICONEXCLAMATION );
+		return FALSE;
+	}
+
+	if( !(pVisual = glXChooseVisual( g_pDisplay, DefaultScreen( g_pDisplay ), attributes )) )
+	{
+		KillGLWindow();
+		MessageBox( NULL, "Failed to find a suitable visual", "ERROR", MB_OK | MB_ICONEXCLAMATION );
+		return FALSE;
+	}
+
+	root = RootWindow( g_pDisplay, pVisual->screen );
+
+	windowAttributes.colormap   = XCreateColormap( g_pDisplay, root, pVisual->visual, AllocNone );
+	windowAttributes.event_mask = KeyPressMask | KeyReleaseMask | StructureNotifyMask | FocusChangeMask;
+
+	g_Window = XCreateWindow( g_pDisplay, root, 0, 0, width, height, 0, pVisual->depth, InputOutput,
+		pVisual->visual, CWColormap | CWEventMask, &windowAttributes );
+
+	XStoreName( g_pDisplay, g_Window, title );
+
+	// Closing the window sends a message instead of killing the connection
+	g_WmDeleteWindow = XInternAtom( g_pDisplay, "WM_DELETE_WINDOW", False );
+	XSetWMProtocols( g_pDisplay, g_Window, &g_WmDeleteWindow, 1 );
+
+	// Held keys do not send release events, like Win32 auto-repeat
+	XkbSetDetectableAutoRepeat( g_pDisplay, True, NULL );
+
+	g_Context = glXCreateContext( g_pDisplay, pVisual, NULL, True );
+	XFree( pVisual );
+
+	if( !g_Context || !glXMakeCurrent( g_pDisplay, g_Window, g_Context ) )
+	{
+		KillGLWindow();
+		MessageBox( NULL, "Failed to create the GLX context", "ERROR", MB_OK | MB_ICONEXCLAMATION );
+		return FALSE;
+	}
+
+	XMapWindow( g_pDisplay, g_Window );
+
+	if( !InitGL() )
+	{
+		KillGLWindow();
+		MessageBox( NULL, "Initialization Failed", "ERROR", MB_OK | MB_ICONEXCLAMATION );
+		return FALSE;
+	}
+
 	g_bActiveWindow = true;
-	g_nScore = 0;
-	g_fMultiplier = 1.0f;
-	g_dwLastScoreTime = GetTickCount();
-	g_nLevel = 1;
+	ReSizeGLScene( width, height );
+
+	cpInitChipmunk();
+
+	InitWorld();
+
+	return TRUE;
+}
+
+void SwapGLBuffers( void )
+{
+	glXSwapBuffers( g_pDisplay, g_Window );
+}
+///***********************************************************///
+#endif
+
+///***********************************************************///
+/// Handler and entry-point
+///***********************************************************///
+
+#if !defined( HEADLESS ) && !defined( OFFSCREEN )
+// Input handlers shared by the window backends, keys are Win32 virtual key codes
+void OnKeyDown( unsigned int nKey )
+{
+	if( nKey >= sizeof( g_bKeys ) )
+	{
+		return;
+	}
+
+	// Profiler toggles, ignoring auto-repeat
+	if( !g_bKeys[nKey] )
+	{
+		if( nKey == VK_F1 )
+		{
+			g_bProfileOverlay = !g_bProfileOverlay;
+		}
+		else if( nKey == VK_F2 )
+		{
+			if( g_pProfileLog )
+				CloseProfileLog();
+			else
+				OpenProfileLog( "profile.csv" );
+		}
+		else if( nKey == VK_F3 )
+		{
+			if( g_pHashLog )
+				CloseHashLog();
+			else
+				OpenHashLog( "hash.csv" );
+		}
+		else if( nKey == VK_F4 )
+		{
+			g_nEdgeQuality = (g_nEdgeQuality + 1) % COUNT_EDGE_QUALITY;
+		}
+	}
+
+	g_bKeys[nKey] = TRUE;
+}
+
+void OnKeyUp( unsigned int nKey )
+{
+	if( nKey < sizeof( g_bKeys ) )
+	{
+		g_bKeys[nKey] = FALSE;
+	}
+}
+
+// Applied before the next frame, a drag sends many of these
+void OnResize( GLsizei nWidth, GLsizei nHeight )
+{
+	g_nResizeWidth  = nWidth;
+	g_nResizeHeight = nHeight;
+	g_bResizePending = true;
 }
 
-// Destroys the physics space
-void DestroyWorld( void )
-{
-	FreeArrays();
+// Main loop of the windowed builds
+int RunGame( void )
+{
+	while( bRun && HandleWindowEvents() )
+	{
+		if( g_bResizePending )
+		{
+			ReSizeGLScene( g_nResizeWidth, g_nResizeHeight );
+			g_bResizePending = false;
+		}
+
+		if( (g_bActiveWindow && !DrawGLScene()) || g_bKeys[VK_ESCAPE] )
+		{
+			bRun = false;
+		}
+		else
+		{
+			SwapGLBuffers();
+		}
+	}
+
+	CloseProfileLog();
+	CloseHashLog();
+	CloseReplay();
+
+	KillGLWindow();
+	return 0;
 }
 
-// Initialize the physics space
-void InitWorld( void )
+#ifndef LINUX
+LRESULT CALLBACK WndProc( HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam )
 {
-	cpFloat x = 0.0f, y = 0.0f, xBuf = 0.0f, yBuf = 0.0f, angle = 0.0f;
+	switch( uMsg )
+	{
+		case WM_ACTIVATE:
+		{
+			if( (LOWORD( wParam ) != WA_INACTIVE) && !((BOOL) HIWORD( wParam )) )
+			{
+				g_bActiveWindow = true;
+			}
+			else
+			{			
+				g_bActiveWindow = false;
+			}
 
-	cpBody* body;
-	cpShape* shape;
-	cpConstraint* constraint;
+			return 0;
+		}
 
-	VertexData* roadFront = new VertexData[TERRAIN_SEGMENTS * 2];
-	VertexData* roadTop   = new VertexData[TERRAIN_SEGMENTS * 2];
-	VertexData* mountainFront = new VertexData[TERRAIN_SEGMENTS * 2];
-	VertexData* mountainTop   = new VertexData[TERRAIN_SEGMENTS * 2];
-	g_pRoadHeightMap = new HeightData[TERRAIN_SEGMENTS];
-	g_pMountainHeightMap = new HeightData[TERRAIN_SEGMENTS];
+		case WM_SYSCOMMAND:
+		{
+			switch( wParam )
+			{
+				case SC_SCREENSAVE:
+				case SC_MONITORPOWER:
 
-	AllocArrays();
+				return 0;
+			}
 
-	//Clear and create a new space
-	cpResetShapeIdCounter();
-	space = cpSpaceNew();
-	space->iterations = 20;
-	cpSpaceResizeActiveHash( space, 0.5f, 150 );
-	space->gravity = cpv(0, -5.0f);
+			break;
+		}
 
-	glGenBuffers( 4, buffers );
+		case WM_CLOSE:
+		{
+			PostQuitMessage( 0 );
 
-	bounds = cpBodyNew( INFINITY, INFINITY );
-	bounds->p = cpv( 0.0f, 0.0f );
+			return 0;
+		}
 
-	g_fTerrainStep = float( TERRAIN_WIDTH ) / float( TERRAIN_SEGMENTS );
+		case WM_KEYDOWN:
+		{
+			OnKeyDown( wParam );
 
-	cpSpaceResizeStaticHash( space, g_fTerrainStep, 40 );
-
-	// Build heightmap
-	float period = 0.5f;
-	for( int i = 0 ; i < TERRAIN_SEGMENTS ; ++i )
-	{
-		float p = float( i ) / float( TERRAIN_SEGMENTS ) * 20.0f * M_PI;
-		y = sin( p * period ) * cos( (p) * 0.1f * period );
-		x = float( i ) * g_fTerrainStep;
-
-		roadFront[i * 2].x  = x;
-		roadFront[i * 2].y  = -1.0f;
-		roadFront[i * 2].z  = 0.0f;
-		roadFront[i * 2].nx = 0.0f;
-		roadFront[i * 2].ny = 0.0f;
-		roadFront[i * 2].nz = 1.0f;
-		roadFront[i * 2].s  = x;
-		roadFront[i * 2].t  = 0.0f;
-
-		roadFront[i * 2 + 1].x  = x;
-		roadFront[i * 2 + 1].y  = y;
-		roadFront[i * 2 + 1].z  = 0.0f;
-		roadFront[i * 2 + 1].nx = 0.0f;
-		roadFront[i * 2 + 1].ny = 0.0f;
-		roadFront[i * 2 + 1].nz = 1.0f;
-		roadFront[i * 2 + 1].s  = x;
-		roadFront[i * 2 + 1].t  = 1.0f;
-
-		angle = (i > 0 ? tan( (yBuf - y) / (x - xBuf) ) : 0);
-		roadTop[i * 2].x  = x;
-		roadTop[i * 2].y  = y;
-		roadTop[i * 2].z  = 0.0f;
-		roadTop[i * 2].nx = cos( angle );
-		roadTop[i * 2].ny = sin( angle );
-		roadTop[i * 2].nz = 0.0f;
-		roadTop[i * 2].s  = x;
-		roadTop[i * 2].t  = 0.0f;
-
-		roadTop[i * 2 + 1].x  = x;
-		roadTop[i * 2 + 1].y  = y;
-		roadTop[i * 2 + 1].z  = -1.0f;
-		roadTop[i * 2 + 1].nx = cos( angle );
-		roadTop[i * 2 + 1].ny = sin( angle );
-		roadTop[i * 2 + 1].nz = 0.0f;
-		roadTop[i * 2 + 1].s  = x;
-		roadTop[i * 2 + 1].t  = 1.0f;
-
-		g_pRoadHeightMap[i].y = y;
-		g_pRoadHeightMap[i].a = angle;
-
-		if( i > 0)
-		{
-			shape = cpSegmentShapeNew( bounds, cpv( xBuf, yBuf ), cpv( x, y ), 0.0f );
-			shape->e = 0.0f; shape->u = 1.0f;
-			shape->collision_type = T_ROAD;
-			shape->layers = LAYER_DEFAULT;
-			cpSpaceAddStaticShape( space, shape );
-		}
-
-		xBuf = x;
-		yBuf = y;
-	}
-
-	period = 1.8f;
-
-	for( int i = 0 ; i < TERRAIN_SEGMENTS ; ++i )
-	{
-		float p = float( i ) / float( TERRAIN_SEGMENTS ) * 20.0f * M_PI;
-		y = 1.5f + sin( p * period ) * cos( (p) * 0.1f * period );
-		x = float( i ) * g_fTerrainStep;
-
-		mountainFront[i * 2].x  = x;
-		mountainFront[i * 2].y  = -1.5f;
-		mountainFront[i * 2].z  = -1.0f;
-		mountainFront[i * 2].nx = 0.0f;
-		mountainFront[i * 2].ny = 0.0f;
-		mountainFront[i * 2].nz = 1.0f;
-		mountainFront[i * 2].s  = x;
-		mountainFront[i * 2].t  = 0.0f;
-
-		mountainFront[i * 2 + 1].x  = x;
-		mountainFront[i * 2 + 1].y  = y;
-		mountainFront[i * 2 + 1].z  = 0.0f;
-		mountainFront[i * 2 + 1].nx = 0.0f;
-		mountainFront[i * 2 + 1].ny = 0.0f;
-		mountainFront[i * 2 + 1].nz = 1.0f;
-		mountainFront[i * 2 + 1].s  = x;
-		mountainFront[i * 2 + 1].t  = 1.0f;
-
-		angle = (i > 0 ? tan( (yBuf - y) / (x - xBuf) ) : 0);
-		mountainTop[i * 2].x  = x;
-		mountainTop[i * 2].y  = y;
-		mountainTop[i * 2].z  = 0.0f;
-		mountainTop[i * 2].nx = cos( angle );
-		mountainTop[i * 2].ny = sin( angle );
-		mountainTop[i * 2].nz = 0.0f;
-		mountainTop[i * 2].s  = x;
-		mountainTop[i * 2].t  = 0.0f;
-
-		mountainTop[i * 2 + 1].x  = x;
-		mountainTop[i * 2 + 1].y  = y;
-		mountainTop[i * 2 + 1].z  = -1.0f;
-		mountainTop[i * 2 + 1].nx = cos( angle );
-		mountainTop[i * 2 + 1].ny = sin( angle );
-		mountainTop[i * 2 + 1].nz = 0.0f;
-		mountainTop[i * 2 + 1].s  = x;
-		mountainTop[i * 2 + 1].t  = 1.0f;
-
-		g_pMountainHeightMap[i].y = y;
-		g_pMountainHeightMap[i].a = angle;
-
-		if( i > 0)
-		{
-			shape = cpSegmentShapeNew( bounds, cpv( xBuf, yBuf ), cpv( x, y ), 0.0f );
-			shape->e = 0.0f; shape->u = 1.0f;
-			shape->sensor = TRUE;
-			shape->collision_type = T_MOUNTAIN;
-			cpSpaceAddStaticShape( space, shape );
+			return 0;
 		}
 
-		xBuf = x;
-		yBuf = y;
-	}
-
-	// Add camera physics to world
-	body = cpBodyNew( 10.0f, cpMomentForCircle( 10.0f, 0.0, WORLD_SCALE, cpvzero ) );
-	body->p = cpv( 0, 0 );
-	body->v_limit = 0;
-	cpSpaceAddBody( space, body );
+		case WM_KEYUP:
+		{
+			OnKeyUp( wParam );
 
-	shape = cpCircleShapeNew( body, WORLD_SCALE, cpvzero );
-	shape->sensor = TRUE;
-	g_Camera.pivot = cpSpaceAddShape( space, shape );
-	constraint = cpGrooveJointNew( bounds, body, cpv( 0, 0 ), cpv( TERRAIN_WIDTH, 0 ), cpv( 0, 0 ) );
+			return 0;
+		}
 
-	body = cpBodyNew( INFINITE, INFINITE );
-	body->p = cpv( 0, 0 );
-	body->v_limit = 0;
-	body->position_func = CameraPositionSync;
-	cpSpaceAddBody( space, body );
+		case WM_SIZE:
+		{
+			OnResize( LOWORD(lParam), HIWORD(lParam) );
 
-	shape = cpCircleShapeNew( body, WORLD_SCALE, cpvzero );
-	shape->sensor = TRUE;
-	g_Camera.player = cpSpaceAddShape( space, shape );
+			return 0;
+		}
+	}
 
-	// Upload bufferdata to vertexbuffer
-	glBindBuffer( GL_ARRAY_BUFFER, buffers[0] );
-	glBufferData( GL_ARRAY_BUFFER, (TERRAIN_SEGMENTS + 1) * sizeof( VertexData ) * 2, roadFront, GL_STATIC_DRAW );
-	
-	glBindBuffer( GL_ARRAY_BUFFER, buffers[1] );
-	glBufferData( GL_ARRAY_BUFFER, (TERRAIN_SEGMENTS + 1) * sizeof( VertexData ) * 2, roadTop, GL_STATIC_DRAW );
+	return DefWindowProc( hWnd, uMsg, wParam, lParam );
+}
 
-	glBindBuffer( GL_ARRAY_BUFFER, buffers[2] );
-	glBufferData( GL_ARRAY_BUFFER, (TERRAIN_SEGMENTS + 1) * sizeof( VertexData ) * 2, mountainFront, GL_STATIC_DRAW );
-	
-	glBindBuffer( GL_ARRAY_BUFFER, buffers[3] );
-	glBufferData( GL_ARRAY_BUFFER, (TERRAIN_SEGMENTS + 1) * sizeof(VertexData ) * 2, mountainTop, GL_STATIC_DRAW );
+bool HandleWindowEvents( void )
+{
+	MSG msg;
 
-	// Left and right boundaries
-	shape = cpSegmentShapeNew( bounds, cpv( 1 * g_fTerrainStep, -5.0f ), cpv( 1* g_fTerrainStep, 10.0f ), 0.0f );
-	shape->e = 0.0f; shape->u = 10.0f;
-	shape->collision_type = T_LEFT_BOUNDARY;
-	cpSpaceAddStaticShape( space, shape );
+	while( PeekMessage( &msg, NULL, 0, 0, PM_REMOVE ) )
+	{
+		if( msg.message == WM_QUIT )
+		{
+			return false;
+		}
 
-	shape = cpSegmentShapeNew( bounds, cpv( 199 * g_fTerrainStep, -5.0f ), cpv( 199 * g_fTerrainStep, 10.0f ), 0.0f );
-	shape->e = 0.0f; shape->u = 10.0f;
-	shape->collision_type = T_RIGHT_BOUNDARY;
-	cpSpaceAddStaticShape( space, shape );
+		TranslateMessage( &msg );
+		DispatchMessage( &msg );
+	}
 
-	shape = cpSegmentShapeNew( bounds, cpv( 190 * g_fTerrainStep, -5.0f ), cpv( 199 * g_fTerrainStep, 10.0f ), 0.0f );
-	shape->e = 0.0f; shape->u = 10.0f;
-	shape->collision_type = T_FINISH;
-	shape->sensor = TRUE;
-	cpSpaceAddStaticShape( space, shape );
+	return true;
+}
 
-	StartLevel();
+int __stdcall WinMain( HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int nCmdShow )
+{
+	char szOption[16], szFileName[MAX_PATH];
 
-	// Collision handlers
-	cpSpaceAddCollisionHandler( space, T_CHASSIS, T_FINISH,			 NewLevel,				   NULL, NULL, NULL, NULL );
-	cpSpaceAddCollisionHandler( space, T_CHASSIS, T_WHEEL_TRAILER,	 KillNpcHandler,		   NULL, NULL, NULL, NULL );
-	cpSpaceAddCollisionHandler( space, T_WHEEL,   T_WHEEL_TRAILER,	 KillNpcHandler,		   NULL, NULL, NULL, NULL );
-	cpSpaceAddCollisionHandler( space, T_ROCK,    T_WHEEL_TRAILER,	 KillNpcHandler,		   NULL, NULL, NULL, NULL );
+	InitGlobals();
 
-	delete[] roadTop;
-	delete[] roadFront;
-	delete[] mountainTop;
-	delete[] mountainFront;
-}
+	// Replays: -record file or -play file
+	if( sscanf( lpCmdLine, "%15s %259s", szOption, szFileName ) == 2 )
+	{
+		if( (!strcmp( szOption, "-record" ) && !OpenReplayRecord( szFileName )) ||
+			(!strcmp( szOption, "-play" ) && !OpenReplayPlay( szFileName )) )
+		{
+			MessageBox( NULL, "Could not open the replay.", "ERROR", MB_OK | MB_ICONEXCLAMATION );
+			return 0;
+		}
+	}
 
-///***********************************************************///
+	// Make sure width and height are equal and power of 2
+	if ( !CreateGLWindow( "NHTV Demo", 512, 512, 32, false ) )
+	{
+		return 0;
+	}
 
-///***********************************************************///
-/// Window initialization
-///***********************************************************///
+	return RunGame();
+}
+#else
+// Key code of an X11 key symbol, 0 for keys the game does not use
+unsigned int TranslateKey( KeySym key )
+{
+	switch( key )
+	{
+		case XK_Shift_L:
+		case XK_Shift_R:	return VK_SHIFT;
+		case XK_Escape:		return VK_ESCAPE;
+		case XK_space:		return VK_SPACE;
+		case XK_Left:		return VK_LEFT;
+		case XK_Right:		return VK_RIGHT;
+		case XK_F1:			return VK_F1;
+		case XK_F2:			return VK_F2;
+		case XK_F3:			return VK_F3;
+		case XK_F4:			return VK_F4;
+		default:			return 0;
+	}
+}
 
-GLvoid KillGLWindow( GLvoid )
+bool HandleWindowEvents( void )
 {
-	DestroyWorld();
+	XEvent event;
+	unsigned int nKey;
 
-	if( hRC )
+	while( XPending( g_pDisplay ) )
 	{
-		if( !wglMakeCurrent( NULL, NULL ) )
-		{
-			MessageBox( NULL, "Release Of DC And RC Failed.", "SHUTDOWN ERROR", MB_OK | MB_ICONINFORMATION );
-		}
+		XNextEvent( g_pDisplay, &event );
 
-		if( !wglDeleteContext( hRC ) )
+		switch( event.type )
 		{
-			MessageBox( NULL, "Release Rendering Context Failed.", "SHUTDOWN ERROR", MB_OK | MB_ICONINFORMATION );
+			case KeyPress:
+			case KeyRelease:
+				// Keys the game does not use are not tracked
+				if( !(nKey = TranslateKey( XLookupKeysym( &event.xkey, 0 ) )) )
+					break;
+
+				if( event.type == KeyPress )
+					OnKeyDown( nKey );
+				else
+					OnKeyUp( nKey );
+				break;
+			case ConfigureNotify:
+				OnResize( event.xconfigure.width, event.xconfigure.height );
+				break;
+			case FocusIn:
+				g_bActiveWindow = true;
+				break;
+			case FocusOut:
+				g_bActiveWindow = false;
+				break;
+			case ClientMessage:
+				if( (Atom) event.xclient.data.l[0] == g_WmDeleteWindow )
+					return false;
+				break;
+			default:
+				break;
 		}
-
-		hRC = NULL;
 	}
 
-	if( hDC && !ReleaseDC( hWnd, hDC ) )
-	{
-		MessageBox( NULL, "Release Device Context Failed.", "SHUTDOWN ERROR", MB_OK | MB_ICONINFORMATION );
-		hDC = NULL;
-	}
+	return true;
+}
 
-	if( hWnd && !DestroyWindow( hWnd ) )
+// Usage: game [-record file | -play file]
+int main( int argc, char** argv )
+{
+	InitGlobals();
+
+	if( argc == 3 )
 	{
-		MessageBox( NULL, "Could Not Release hWnd.", "SHUTDOWN ERROR", MB_OK | MB_ICONINFORMATION );
-		hWnd = NULL;
+		if( (!strcmp( argv[1], "-record" ) && !OpenReplayRecord( argv[2] )) ||
+			(!strcmp( argv[1], "-play" ) && !OpenReplayPlay( argv[2] )) )
+		{
+			MessageBox( NULL, "Could not open the replay.", "ERROR", MB_OK | MB_ICONEXCLAMATION );
+			return 1;
+		}
 	}
 
-	if( !UnregisterClass( "OpenGL", hInstance ) )
+	if ( !CreateGLWindow( "NHTV Demo", 512, 512, 32, false ) )
 	{
-		MessageBox( NULL, "Could Not Unregister Class.", "SHUTDOWN ERROR", MB_OK | MB_ICONINFORMATION );
-		hInstance = NULL;
+		return 1;
 	}
+
+	return RunGame();
 }
+#endif
+#else
+// Scripted input, each line of a script holds a number of frames and the keys
+// held during those frames: R = accelerate, L = brake, B = boost, S = shoot axle
+// and - for none. The script is repeated until the simulation ends.
+#define MAX_SCRIPT_LINES		256
 
-GLvoid ReSizeGLScene( GLsizei width, GLsizei height )
+struct ScriptLine
 {
-	if ( height == 0 )
+	unsigned int	nFrames;
+	char			szKeys[8];
+};
+
+ScriptLine		g_Script[MAX_SCRIPT_LINES];
+unsigned int	g_nScriptLines;
+unsigned int	g_nScriptFrames;
+
+bool LoadScript( const char* szFileName )
+{
+	FILE* pFile;
+	ScriptLine line;
+
+	if( !(pFile = fopen( szFileName, "r" )) )
 	{
-		height = 1;
+		return false;
 	}
 
-	// Create framebuffers en textures
-	InitBuffers( width, height );
-
-	glViewport( 0, 0, width, height );
+	g_nScriptLines = 0;
+	g_nScriptFrames = 0;
 
-	glMatrixMode( GL_PROJECTION );
-	glLoadIdentity();
+	while( g_nScriptLines < MAX_SCRIPT_LINES && fscanf( pFile, "%u %7s", &line.nFrames, line.szKeys ) == 2 )
+	{
+		g_Script[g_nScriptLines++] = line;
+		g_nScriptFrames += line.nFrames;
+	}
 
-	gluPerspective( 45.0f, (GLfloat) width / (GLfloat) height, 0.1f, 10.0f );
+	fclose( pFile );
 
-	glMatrixMode( GL_MODELVIEW );
-	glLoadIdentity();
+	return g_nScriptFrames > 0;
 }
 
-int CreateGLWindow( char* title, int width, int height, int bits, bool fullscreen )
+// Set the keys held at the given frame
+void ApplyScript( unsigned int nFrame )
 {
-	GLuint		PixelFormat;
-	WNDCLASS	wc;		
-	DWORD		dwExStyle;
-	DWORD		dwStyle;
-	RECT		WindowRect;
+	unsigned int i = 0;
+	nFrame %= g_nScriptFrames;
 
-	WindowRect.left   = (long) 0;
-	WindowRect.right  = (long) width;
-	WindowRect.top    = (long) 0;
-	WindowRect.bottom = (long) height;
+	while( nFrame >= g_Script[i].nFrames )
+	{
+		nFrame -= g_Script[i++].nFrames;
+	}
 
-	hInstance			= GetModuleHandle( NULL );
-	wc.style			= CS_HREDRAW | CS_VREDRAW | CS_OWNDC;
-	wc.lpfnWndProc		= (WNDPROC) WndProc;
-	wc.cbClsExtra		= 0;
-	wc.cbWndExtra		= 0;
-	wc.hInstance		= hInstance;
-	wc.hIcon			= LoadIcon( NULL, IDI_WINLOGO );
-	wc.hCursor			= LoadCursor( NULL, IDC_ARROW );
-	wc.hbrBackground	= NULL;
-	wc.lpszMenuName		= NULL;
-	wc.lpszClassName	= "OpenGL";
+	g_bKeys[VK_RIGHT] = strchr( g_Script[i].szKeys, 'R' ) != NULL;
+	g_bKeys[VK_LEFT]  = strchr( g_Script[i].szKeys, 'L' ) != NULL;
+	g_bKeys[VK_SHIFT] = strchr( g_Script[i].szKeys, 'B' ) != NULL;
+	g_bKeys[VK_SPACE] = strchr( g_Script[i].szKeys, 'S' ) != NULL;
+}
 
-	if( !RegisterClass( &wc ) )
-	{
-		MessageBox( NULL, "Failed To Register The Window Class.", "ERROR", MB_OK | MB_ICONEXCLAMATION );
+#ifdef OFFSCREEN
+// Offscreen rendering, OSMesa renders into a block of client memory instead of a window
+OSMesaContext	g_OffscreenContext;
+GLubyte*		g_pOffscreenBuffer;
+GLsizei			g_nOffscreenWidth;
+GLsizei			g_nOffscreenHeight;
 
-		return FALSE;
+bool CreateOffscreenContext( GLsizei nWidth, GLsizei nHeight )
+{
+	// Depth and stencil are in the scene render target, the buffer only holds the final image
+	if( !(g_OffscreenContext = OSMesaCreateContextExt( OSMESA_RGBA, 0, 0, 0, NULL )) )
+	{
+		return false;
 	}
 
-	if( fullscreen )
+	g_nOffscreenWidth  = nWidth;
+	g_nOffscreenHeight = nHeight;
+	g_pOffscreenBuffer = new GLubyte[nWidth * nHeight * 4];
+
+	if( !OSMesaMakeCurrent( g_OffscreenContext, g_pOffscreenBuffer, GL_UNSIGNED_BYTE, nWidth, nHeight ) )
 	{
-		DEVMODE dmScreenSettings;
-		ZeroMemory( &dmScreenSettings, sizeof( dmScreenSettings ) );
+		return false;
+	}
 
-		dmScreenSettings.dmSize			= sizeof( dmScreenSettings );
-		dmScreenSettings.dmPelsWidth	= width;
-		dmScreenSettings.dmPelsHeight	= height;
-		dmScreenSettings.dmBitsPerPel	= bits;
-		dmScreenSettings.dmFields		= DM_BITSPERPEL | DM_PELSWIDTH | DM_PELSHEIGHT;
+	if( !InitGL() )
+	{
+		return false;
+	}
 
-		if( ChangeDisplaySettings( &dmScreenSettings, CDS_FULLSCREEN ) != DISP_CHANGE_SUCCESSFUL )
-		{
-			if( MessageBox( NULL, "The Requested Fullscreen Mode Is Not Supported By\nYour Video Card. Use Windowed Mode Instead?", "", MB_YESNO | MB_ICONEXCLAMATION ) == IDYES )
-			{
-				fullscreen = FALSE;
-			}
-			else
-			{
-				MessageBox( NULL, "Program Will Now Close.", "ERROR", MB_OK | MB_ICONSTOP );
+	ReSizeGLScene( nWidth, nHeight );
 
-				return FALSE;
-			}
-		}
-	}
+	return true;
+}
 
-	if( fullscreen )	
+void DestroyOffscreenContext( void )
+{
+	if( g_OffscreenContext )
 	{
-		dwExStyle = WS_EX_APPWINDOW;
-		dwStyle   = WS_POPUP;
-		ShowCursor( FALSE );
+		OSMesaDestroyContext( g_OffscreenContext );
+		g_OffscreenContext = NULL;
 	}
-	else
+
+	delete[] g_pOffscreenBuffer;
+	g_pOffscreenBuffer = NULL;
+}
+
+// Write the last rendered frame as an uncompressed 32 bit .tga, the format BindTGAData reads
+bool WriteFrame( const char* szFileName )
+{
+	const GLsizei w = g_nOffscreenWidth, h = g_nOffscreenHeight;
+	unsigned char header[18] = { 0 };
+	FILE* pFile;
+	GLsizei i;
+
+	glFinish();
+
+	if( !(pFile = fopen( szFileName, "wb" )) )
 	{
-		dwExStyle = WS_EX_APPWINDOW | WS_EX_WINDOWEDGE;
-		dwStyle   = WS_OVERLAPPEDWINDOW;
+		return false;
 	}
 
-	AdjustWindowRectEx( &WindowRect, dwStyle, FALSE, dwExStyle );
+	// Uncompressed true colour, origin bottom left like the OSMesa buffer
+	header[2]  = 2;
+	header[12] = w & 0xFF;
+	header[13] = (w >> 8) & 0xFF;
+	header[14] = h & 0xFF;
+	header[15] = (h >> 8) & 0xFF;
+	header[16] = 32;
+	header[17] = 8;
 
-	if( !(hWnd = CreateWindowEx( dwExStyle, 
-							    "OpenGL", 
-							    title, 
-							    dwStyle | WS_CLIPSIBLINGS | WS_CLIPCHILDREN, 
-							    0, 
-						     	0, 
-							    WindowRect.right-WindowRect.left, 
-							    WindowRect.bottom-WindowRect.top,
-							    NULL,
-							    NULL,
-							    hInstance,
-							    NULL )) )
+	fwrite( header, sizeof( header ), 1, pFile );
+
+	// RGBA to BGRA
+	for( i = 0; i < w * h; ++i )
 	{
-		KillGLWindow();
-		MessageBox( NULL, "Failed to create window", "ERROR", MB_OK | MB_ICONEXCLAMATION );
+		const GLubyte* p = &g_pOffscreenBuffer[i * 4];
+		const unsigned char bgra[4] = { p[2], p[1], p[0], p[3] };
 
-		return FALSE;
+		fwrite( bgra, sizeof( bgra ), 1, pFile );
 	}
 
-	static	PIXELFORMATDESCRIPTOR pfd =
-	{
-		sizeof(PIXELFORMATDESCRIPTOR),
-		1,		
-		PFD_DRAW_TO_WINDOW | PFD_SUPPORT_OPENGL | PFD_DOUBLEBUFFER,
-		PFD_TYPE_RGBA,
-		bits,
-		0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 16, 0, 0,
-		PFD_MAIN_PLANE,
-		0, 0, 0, 0
-	};
-	
-	if( !(hDC = GetDC( hWnd )) )
-	{
-		KillGLWindow();
-		MessageBox( NULL, "Failed to create OpenGL DC", "ERROR", MB_OK | MB_ICONEXCLAMATION );
+	fclose( pFile );
 
-		return FALSE;
-	}
+	return true;
+}
+#endif
 
-	if( !(PixelFormat = ChoosePixelFormat( hDC,&pfd )) )
+#ifdef BENCHMARK
+// Allocation counter, counts every heap allocation of the game and Chipmunk by
+// wrapping the glibc allocator
+extern "C" void* __libc_malloc( size_t size );
+extern "C" void* __libc_calloc( size_t count, size_t size );
+extern "C" void* __libc_realloc( void* ptr, size_t size );
+
+unsigned int g_nAllocations;
+
+extern "C" void* malloc( size_t size )
+{
+	++g_nAllocations;
+	return __libc_malloc( size );
+}
+
+extern "C" void* calloc( size_t count, size_t size )
+{
+	++g_nAllocations;
+	return __libc_calloc( count, size );
+}
+
+extern "C" void* realloc( void* ptr, size_t size )
+{
+	++g_nAllocations;
+	return __libc_realloc( ptr, size );
+}
+
+int CompareTimes( const void* a, const void* b )
+{
+	double d = *(const double*) a - *(const double*) b;
+	return (d > 0.0) - (d < 0.0);
+}
+
+// Terrain kernel against the previous per vertex loop (libm sine, cosine and tangent per vertex),
+// heights and normals of both layers of the whole level, in ns per vertex
+#define BENCHMARK_TERRAIN_RUNS	200
+
+void BenchmarkTerrain( FILE* pOut )
+{
+	const int nCount = TERRAIN_CHUNK_SEGMENTS + 1;
+	float y[TERRAIN_CHUNK_SEGMENTS + 3], nx[TERRAIN_CHUNK_SEGMENTS + 1], ny[TERRAIN_CHUNK_SEGMENTS + 1];
+	volatile float fSink = 0.0f;
+	double times[3], fError = 0.0;
+	unsigned int nRun, nLayer, nVertices = 0;
+	int nFirst, i;
+
+	g_fTerrainStep = float( TERRAIN_WIDTH ) / float( TERRAIN_SEGMENTS );
+
+	// Previous loop
+	double time = GetTime();
+	for( nRun = 0; nRun < BENCHMARK_TERRAIN_RUNS; ++nRun )
 	{
-		KillGLWindow();
-		MessageBox( NULL, "Failed to choose PixelFormat", "ERROR", MB_OK | MB_ICONEXCLAMATION );
+		for( nLayer = 0; nLayer < COUNT_TERRAIN_LAYERS; ++nLayer )
+		{
+			const TerrainLayerData & layer = terrainLayers[nLayer];
 
-		return FALSE;
+			for( i = 0; i <= LEVEL_RIGHT; ++i )
+			{
+				cpFloat p = i * TERRAIN_FREQUENCY, q = (i - 1) * TERRAIN_FREQUENCY;
+				cpFloat h = layer.fBase + sin( p * layer.fPeriod ) * cos( p * 0.1f * layer.fPeriod );
+				cpFloat a = tan( (layer.fBase + sin( q * layer.fPeriod ) * cos( q * 0.1f * layer.fPeriod ) - h) / g_fTerrainStep );
+				fSink = fSink + float( h + cos( a ) + sin( a ) );
+			}
+		}
 	}
+	times[0] = GetTime() - time;
 
-	if( !SetPixelFormat( hDC, PixelFormat, &pfd ) )
+	// Kernel, scalar and SSE
+	for( unsigned int nPath = 0; nPath < 2; ++nPath )
 	{
-		KillGLWindow();
-		MessageBox( NULL, "Failed to set PixelFormat", "ERROR",MB_OK|MB_ICONEXCLAMATION );
+		g_bTerrainSimd = nPath == 1;
 
-		return FALSE;
+		time = GetTime();
+		for( nRun = 0; nRun < BENCHMARK_TERRAIN_RUNS; ++nRun )
+		{
+			for( nLayer = 0; nLayer < COUNT_TERRAIN_LAYERS; ++nLayer )
+			{
+				for( nFirst = 0; nFirst <= LEVEL_RIGHT; nFirst += nCount )
+				{
+					EvaluateTerrainY( nLayer, nFirst - 1, nCount + 2, y );
+					EvaluateTerrainNormals( y, nCount, g_fTerrainStep, nx, ny );
+					fSink = fSink + y[1] + nx[0] + ny[0];
+				}
+			}
+		}
+		times[nPath + 1] = GetTime() - time;
 	}
 
-	if( !(hRC=wglCreateContext( hDC )) )
+	// Largest height error of the kernel against libm
+	for( nLayer = 0; nLayer < COUNT_TERRAIN_LAYERS; ++nLayer )
 	{
-		KillGLWindow();
-		MessageBox( NULL, "Failed to create OpenGL RC", "ERROR", MB_OK | MB_ICONEXCLAMATION );
+		const TerrainLayerData & layer = terrainLayers[nLayer];
 
-		return FALSE;
+		for( nFirst = 0; nFirst <= LEVEL_RIGHT; nFirst += nCount )
+		{
+			EvaluateTerrainY( nLayer, nFirst, nCount, y );
+
+			for( i = 0; i < nCount; ++i )
+			{
+				cpFloat p = (nFirst + i) * TERRAIN_FREQUENCY;
+				cpFloat d = fabs( y[i] - (layer.fBase + sin( p * layer.fPeriod ) * cos( p * 0.1f * layer.fPeriod )) );
+				fError = d > fError ? d : fError;
+			}
+		}
+
+		nVertices += LEVEL_RIGHT + 1;
 	}
 
-	if( !wglMakeCurrent( hDC, hRC ) )
+	g_bTerrainSimd = true;
+
+	fprintf( pOut, "\t\"terrain\": { \"vertices\": %u, \"ns_per_vertex_reference\": %.2f, \"ns_per_vertex_scalar\": %.2f, "
+		"\"ns_per_vertex_simd\": %.2f, \"max_height_error\": %.2e },\n",
+		nVertices, times[0] / BENCHMARK_TERRAIN_RUNS / nVertices * 1e9, times[1] / BENCHMARK_TERRAIN_RUNS / nVertices * 1e9,
+		times[2] / BENCHMARK_TERRAIN_RUNS / nVertices * 1e9, fError );
+}
+
+// Usage: benchmark [-levels n] [-ticks n] [-warmup n] [-seed n] [-out file]
+// Builds the world of every level from 1 to n, runs a fixed number of physics
+// ticks without player input and writes the step times as JSON. Every level is run
+// with all bodies awake and with sleeping bodies, ns_per_step_awake against ns_per_step
+int main( int argc, char** argv )
+{
+	unsigned int nLevels = 10;
+	unsigned int nTicks = 600;
+	unsigned int nWarmup = 60;
+	unsigned int nSeed = 1;
+	FILE* pOut = stdout;
+	double* pTimes;
+
+	for( int i = 1; i < argc; ++i )
 	{
-		KillGLWindow();
-		MessageBox( NULL, "Failed to activate OpenGL RC", "ERROR", MB_OK | MB_ICONEXCLAMATION );
-		return FALSE;
+		if( !strcmp( argv[i], "-levels" ) && i + 1 < argc )
+		{
+			nLevels = atoi( argv[++i] );
+		}
+		else if( !strcmp( argv[i], "-ticks" ) && i + 1 < argc )
+		{
+			nTicks = atoi( argv[++i] );
+		}
+		else if( !strcmp( argv[i], "-warmup" ) && i + 1 < argc )
+		{
+			nWarmup = atoi( argv[++i] );
+		}
+		else if( !strcmp( argv[i], "-seed" ) && i + 1 < argc )
+		{
+			nSeed = strtoul( argv[++i], NULL, 10 );
+		}
+		else if( !strcmp( argv[i], "-out" ) && i + 1 < argc )
+		{
+			if( !(pOut = fopen( argv[++i], "w" )) )
+			{
+				fprintf( stderr, "Failed to open %s\n", argv[i] );
+				return 1;
+			}
+		}
+		else
+		{
+			fprintf( stderr, "Usage: %s [-levels n] [-ticks n] [-warmup n] [-seed n] [-out file]\n", argv[0] );
+			return 1;
+		}
 	}
 
-	if( !InitGL() )
+	if( nTicks == 0 )
 	{
-		KillGLWindow();
-		MessageBox( NULL, "Initialization Failed", "ERROR", MB_OK | MB_ICONEXCLAMATION );
-		return FALSE;
+		fprintf( stderr, "At least one tick is needed\n" );
+		return 1;
 	}
 
-	ShowWindow( hWnd,SW_SHOW );
-	SetForegroundWindow( hWnd );
-	SetFocus( hWnd);
-	ReSizeGLScene( width, height );
+	pTimes = new double[nTicks];
 
 	cpInitChipmunk();
 
-	InitWorld();
-
-	return TRUE;
-}
-///***********************************************************///
+	fprintf( pOut, "{\n\t\"seed\": %u,\n\t\"ticks\": %u,\n\t\"warmup\": %u,\n\t\"substeps\": %d,\n",
+		nSeed, nTicks, nWarmup, PHYSICS_SUBSTEPS );
 
-///***********************************************************///
-/// Handler and entry-point
-///***********************************************************///
+	BenchmarkTerrain( pOut );
+	fprintf( pOut, "\t\"levels\": [\n" );
 
-LRESULT CALLBACK WndProc( HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam )
-{
-	switch( uMsg )
+	for( unsigned int nLevel = 1; nLevel <= nLevels; ++nLevel )
 	{
-		case WM_ACTIVATE:
+		unsigned int nSetupAllocations, nStepAllocations, nSleeping = 0;
+		unsigned int i, nPass;
+		double total, totalAwake = 0.0;
+
+		// Every level runs with all bodies awake first, then with sleeping as in the game
+		for( nPass = 0; nPass < 2; ++nPass )
 		{
-			if( (LOWORD( wParam ) != WA_INACTIVE) && !((BOOL) HIWORD( wParam )) )
+			g_bSleeping = nPass == 1;
+			total = 0.0;
+
+			// Build the world of this level through the same code as the game
+			InitGlobals();
+			g_nWorldSeed = nSeed;
+			g_nLevel = nLevel;
+
+			g_nAllocations = 0;
+			InitWorld();
+			nSetupAllocations = g_nAllocations;
+
+			for( i = 0; i < nWarmup; ++i )
 			{
-				g_bActiveWindow = true;
-			}
-			else
-			{			
-				g_bActiveWindow = false;
+				UpdateSpace();
 			}
 
-			return 0;
-		}
+			g_nAllocations = 0;
 
-		case WM_SYSCOMMAND:
-		{
-			switch( wParam )
+			for( i = 0; i < nTicks; ++i )
 			{
-				case SC_SCREENSAVE:
-				case SC_MONITORPOWER:
-
-				return 0;
+				double time = GetTime();
+				UpdateSpace();
+				pTimes[i] = GetTime() - time;
+				total += pTimes[i];
 			}
 
-			break;
+			nStepAllocations = g_nAllocations;
+
+			if( nPass == 0 )
+			{
+				totalAwake = total;
+				DestroyWorld();
+			}
 		}
 
-		case WM_CLOSE:
+		for( i = 0; i < g_Vehicles.nSlots; ++i )
 		{
-			PostQuitMessage( 0 );
-
-			return 0;
+			if( PoolIsLive( g_Vehicles, i ) && g_Vehicles.pData[i].sleeping )
+				++nSleeping;
 		}
 
-		case WM_KEYDOWN:
+		for( i = 0; i < g_Rocks.nSlots; ++i )
 		{
-			g_bKeys[wParam] = TRUE;
-
-			return 0;
+			if( PoolIsLive( g_Rocks, i ) && g_Rocks.pData[i].sleeping )
+				++nSleeping;
 		}
 
-		case WM_KEYUP:
-		{
-			g_bKeys[wParam] = FALSE;
+		qsort( pTimes, nTicks, sizeof( double ), CompareTimes );
 
-			return 0;
-		}
+		fprintf( pOut, "\t\t{ \"level\": %u, \"bodies\": %d, \"shapes_active\": %d, \"arbiters\": %d, \"sleeping\": %u, "
+			"\"ns_per_tick\": %.0f, \"ns_per_step\": %.0f, \"ns_per_step_awake\": %.0f, \"p50_ns\": %.0f, \"p99_ns\": %.0f, "
+			"\"celldim\": %.4f, \"cells\": %d, \"setup_allocations\": %u, \"step_allocations\": %u }%s\n",
+			nLevel, space->bodies->num, space->activeShapes->handleSet->entries, space->arbiters->num, nSleeping,
+			total / nTicks * 1e9, total / nTicks / PHYSICS_SUBSTEPS * 1e9, totalAwake / nTicks / PHYSICS_SUBSTEPS * 1e9,
+			pTimes[nTicks / 2] * 1e9, pTimes[(nTicks * 99) / 100] * 1e9,
+			space->activeShapes->celldim, space->activeShapes->numcells,
+			nSetupAllocations, nStepAllocations, nLevel < nLevels ? "," : "" );
 
-		case WM_SIZE:
-		{
-			ReSizeGLScene( LOWORD(lParam), HIWORD(lParam) );
+		DestroyWorld();
+	}
 
-			return 0;
-		}
+	fprintf( pOut, "\t]\n}\n" );
+
+	if( pOut != stdout )
+	{
+		fclose( pOut );
 	}
 
-	return DefWindowProc( hWnd, uMsg, wParam, lParam );
-}
+	delete[] pTimes;
 
-int __stdcall WinMain( HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int nCmdShow )
+	return 0;
+}
+#else
+// Usage: game [-frames n] [-script file] [-profile file] [-hashlog file] [-seed n] [-record file | -play file]
+// A replay is played back as fast as possible, for all of its ticks
+//
+// The offscreen build renders every tick and also takes [-size w h] [-dump n] [-out prefix]. Every
+// n-th frame is written to prefix_frame.tga, the pass times of every frame to prefix.csv unless
+// -profile is given
+int main( int argc, char** argv )
 {
-	MSG msg;
+	unsigned int nFrames = 3600;
+	unsigned int nFrame;
+	double start, time;
+#ifdef OFFSCREEN
+	GLsizei nWidth = 512, nHeight = 512;
+	unsigned int nDump = 60;
+	const char* szPrefix = "frame";
+	char szFileName[MAX_PATH];
+#endif
 
-	InitGlobals();
+	// Without a script the player character accelerates all the time
+	g_Script[0].nFrames = 1;
+	strcpy( g_Script[0].szKeys, "R" );
+	g_nScriptLines = 1;
+	g_nScriptFrames = 1;
 
-	// Make sure width and height are equal and power of 2
-	if ( !CreateGLWindow( "NHTV Demo", 512, 512, 32, false ) )
-	{
-		return 0;
-	}
+	InitGlobals();
 
-	while( bRun )
+	for( int i = 1; i < argc; ++i )
 	{
-		if( PeekMessage( &msg, NULL, 0, 0, PM_REMOVE ) )
+		if( !strcmp( argv[i], "-frames" ) && i + 1 < argc )
+		{
+			nFrames = atoi( argv[++i] );
+		}
+		else if( !strcmp( argv[i], "-script" ) && i + 1 < argc )
 		{
-			if( msg.message == WM_QUIT )
+			if( !LoadScript( argv[++i] ) )
 			{
-				bRun = false;
+				fprintf( stderr, "Failed to load script %s\n", argv[i] );
+				return 1;
 			}
-			else
+		}
+		else if( !strcmp( argv[i], "-profile" ) && i + 1 < argc )
+		{
+			if( !OpenProfileLog( argv[++i] ) )
 			{
-				TranslateMessage( &msg );
-				DispatchMessage( &msg );
+				fprintf( stderr, "Failed to open profile %s\n", argv[i] );
+				return 1;
 			}
 		}
-		else
+		else if( !strcmp( argv[i], "-hashlog" ) && i + 1 < argc )
 		{
-			if( (g_bActiveWindow && !DrawGLScene()) || g_bKeys[VK_ESCAPE] )
+			if( !OpenHashLog( argv[++i] ) )
 			{
-				bRun = false;
+				fprintf( stderr, "Failed to open hash log %s\n", argv[i] );
+				return 1;
 			}
-			else
+		}
+		else if( !strcmp( argv[i], "-seed" ) && i + 1 < argc )
+		{
+			g_nWorldSeed = strtoul( argv[++i], NULL, 10 );
+		}
+		else if( !strcmp( argv[i], "-record" ) && i + 1 < argc )
+		{
+			if( !OpenReplayRecord( argv[++i] ) )
 			{
-				SwapBuffers( hDC );
+				fprintf( stderr, "Failed to open replay %s\n", argv[i] );
+				return 1;
 			}
-
-			if( g_bKeys[VK_SHIFT] )
+		}
+		else if( !strcmp( argv[i], "-play" ) && i + 1 < argc )
+		{
+			if( !OpenReplayPlay( argv[++i] ) )
 			{
-				HandlePcVehicle( HANDLING_BOOST );
+				fprintf( stderr, "Failed to load replay %s\n", argv[i] );
+				return 1;
 			}
 
-			if( !g_bKeys[VK_SPACE] && g_bKeyLock )
-			{
-				ShootAxle();
-				g_bKeyLock = FALSE;
-			}
+			nFrames = g_ReplayHeader.nTicks;
+		}
+#ifdef OFFSCREEN
+		else if( !strcmp( argv[i], "-size" ) && i + 2 < argc )
+		{
+			nWidth  = atoi( argv[++i] );
+			nHeight = atoi( argv[++i] );
+		}
+		else if( !strcmp( argv[i], "-dump" ) && i + 1 < argc )
+		{
+			nDump = atoi( argv[++i] );
+		}
+		else if( !strcmp( argv[i], "-out" ) && i + 1 < argc )
+		{
+			szPrefix = argv[++i];
+		}
+#endif
+		else
+		{
+#ifdef OFFSCREEN
+			fprintf( stderr, "Usage: %s [-frames n] [-script file] [-profile file] [-hashlog file] [-seed n] [-record file | -play file] [-size w h] [-dump n] [-out prefix]\n", argv[0] );
+#else
+			fprintf( stderr, "Usage: %s [-frames n] [-script file] [-profile file] [-hashlog file] [-seed n] [-record file | -play file]\n", argv[0] );
+#endif
+			return 1;
+		}
+	}
 
-			if( g_bKeys[VK_SPACE] )
-			{
-				g_bKeyLock = TRUE;
-			}
+#ifdef OFFSCREEN
+	if( !g_pProfileLog )
+	{
+		snprintf( szFileName, sizeof( szFileName ), "%s.csv", szPrefix );
+		OpenProfileLog( szFileName );
+	}
 
-			if( g_bKeys[VK_LEFT] )
-			{
-				HandlePcVehicle( HANDLING_BRAKE );
-			}
+	if( nWidth <= 0 || nHeight <= 0 || !CreateOffscreenContext( nWidth, nHeight ) )
+	{
+		fprintf( stderr, "Failed to create the offscreen context\n" );
+		return 1;
+	}
+#endif
+
+	cpInitChipmunk();
+
+	InitWorld();
+
+	start = GetTime();
+
+	for( nFrame = 0; nFrame < nFrames && bRun; ++nFrame )
+	{
+		if( g_nReplayMode != REPLAY_PLAY )
+		{
+			ApplyScript( nFrame );
+		}
 
-			if( g_bKeys[VK_RIGHT] )
+		UpdateSpace();
+
+		HandleKeys();
+
+#ifdef OFFSCREEN
+		// Render the state of the tick itself, without interpolation, so frames are reproducible
+		RenderGLScene();
+
+		if( nDump && nFrame % nDump == 0 )
+		{
+			snprintf( szFileName, sizeof( szFileName ), "%s_%05u.tga", szPrefix, nFrame );
+
+			if( !WriteFrame( szFileName ) )
 			{
-				HandlePcVehicle( HANDLING_ACCELERATE );
+				fprintf( stderr, "Failed to write %s\n", szFileName );
 			}
 		}
+#else
+		ProfileFrame();
+#endif
 	}
 
-	KillGLWindow();
-	return msg.wParam;
+	CloseProfileLog();
+	CloseHashLog();
+	CloseReplay();
+
+	time = GetTime() - start;
+
+	printf( "Frames: %u\nSeed: %u\nLevel: %u\nScore: %d\nTime: %.0f ms\n", nFrame, g_nWorldSeed, g_nLevel, g_nScore, time * 1000.0 );
+
+	DestroyWorld();
+
+#ifdef OFFSCREEN
+	DestroyOffscreenContext();
+#endif
+
+	return 0;
 }
+#endif
+#endif
 
 ///***********************************************************///
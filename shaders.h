@@ -6,6 +6,7 @@
  * See: http://en.wikipedia.org/wiki/Sobel_operator
  * See: http://en.wikipedia.org/wiki/Framebuffer_Object
  * See: http://www.geeks3d.com/20091216/geexlab-how-to-visualize-the-depth-buffer-in-glsl/
+ * See: http://jcgt.org/published/0003/02/01/ (octahedral normal encoding)
  *
  * By: Marlon Etheredge <m.etheredge@gmail.com>
  */
@@ -13,12 +14,14 @@
 const GLchar vertexShaderDefault[] = 
 	"varying vec3 vertexNormal;"
 	"varying float NdotL;"
+	"varying float eyeDepth;"
 	""
 	"void main( void )"
 	"{"
 	"	vertexNormal = normalize( gl_NormalMatrix * gl_Normal );"						// Pass normal
 	""
 	"	vec4 vertexWorldSpace = gl_ModelViewMatrix * gl_Vertex;"						// Set position in world space
+	"	eyeDepth = -vertexWorldSpace.z;"												// Pass linear depth
 	""																		
 	"	vec3 lightDirection = gl_LightSource[0].position.xyz - vertexWorldSpace.xyz;"	// Calculate vertex to light
 	"	NdotL = max( dot( vertexNormal, normalize( lightDirection ) ), 0.0 );"
@@ -27,11 +30,77 @@ const GLchar vertexShaderDefault[] =
 	"	gl_TexCoord[0] = gl_MultiTexCoord0;"											// Pass texture coords
 	"}";
 
+const GLchar vertexShaderInstanced[] = 
+	"attribute vec4 instancePosition;"													// Position xyz and angle
+	"attribute vec2 instanceScale;"														// Scale and flip (-1 mirrors x and z)
+	""
+	"varying vec3 vertexNormal;"
+	"varying float NdotL;"
+	"varying float eyeDepth;"
+	""
+	"void main( void )"
+	"{"
+	"	float c = cos( instancePosition.w );"
+	"	float s = sin( instancePosition.w );"
+	"	mat2 rotation = mat2( c, s, -s, c );"
+	""
+	"	vec3 position = gl_Vertex.xyz;"
+	"	vec3 normal = gl_Normal;"
+	"	position.xz *= instanceScale.y;"
+	"	normal.xz *= instanceScale.y;"
+	"	position.xy = rotation * position.xy;"
+	"	normal.xy = rotation * normal.xy;"
+	"	position = position * instanceScale.x + instancePosition.xyz;"					// Instance to model space
+	""
+	"	vertexNormal = normalize( gl_NormalMatrix * normal );"							// Pass normal
+	""
+	"	vec4 vertexWorldSpace = gl_ModelViewMatrix * vec4( position, 1.0 );"			// Set position in world space
+	"	eyeDepth = -vertexWorldSpace.z;"												// Pass linear depth
+	""
+	"	vec3 lightDirection = gl_LightSource[0].position.xyz - vertexWorldSpace.xyz;"	// Calculate vertex to light
+	"	NdotL = max( dot( vertexNormal, normalize( lightDirection ) ), 0.0 );"
+	""
+	"	gl_Position = gl_ModelViewProjectionMatrix * vec4( position, 1.0 );"			// Position to camera space
+	"	gl_TexCoord[0] = gl_MultiTexCoord0;"											// Pass texture coords
+	"}";
+
+// G-buffer layout, one RGBA8 target: xy octahedral normal, zw linear depth over camera far in 16 bits
+#define SHADER_GBUFFER_OCT \
+	"vec2 signNotZero( vec2 v )" \
+	"{" \
+	"	return vec2( v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0 );" \
+	"}"
+
+#define SHADER_GBUFFER_ENCODE \
+	SHADER_GBUFFER_OCT \
+	"" \
+	"vec4 encodeGBuffer( vec3 n, float depth )" \
+	"{" \
+	"	n /= abs( n.x ) + abs( n.y ) + abs( n.z );" \
+	"	vec2 e = n.z >= 0.0 ? n.xy : (1.0 - abs( n.yx )) * signNotZero( n.xy );" \
+	"	float d = clamp( depth / 10.0, 0.0, 1.0 ) * 255.0;" \
+	"	return vec4( e * 0.5 + 0.5, floor( d ) / 255.0, fract( d ) );" \
+	"}"
+
+#define SHADER_GBUFFER_DECODE \
+	SHADER_GBUFFER_OCT \
+	"" \
+	"vec4 decodeGBuffer( vec4 g )" \
+	"{" \
+	"	vec2 e = g.xy * 2.0 - 1.0;" \
+	"	vec3 n = vec3( e, 1.0 - abs( e.x ) - abs( e.y ) );" \
+	"	if( n.z < 0.0 ) n.xy = (1.0 - abs( n.yx )) * signNotZero( n.xy );" \
+	"	return vec4( normalize( n ), (g.z + g.w / 255.0) * 10.0 );" \
+	"}"
+
 const GLchar fragmentShaderScene[] =
 	"uniform sampler2D tex;"
 	""
 	"varying vec3 vertexNormal;"
 	"varying float NdotL;"
+	"varying float eyeDepth;"
+	""
+	SHADER_GBUFFER_ENCODE
 	""
 	"float hardstep( float x )"															// Hardstep light intensity
 	"{"
@@ -59,57 +128,85 @@ const GLchar fragmentShaderScene[] =
 	""
 	"	color = color * vec4( gl_LightSource[0].diffuse.xyz, 1 ) * (ambient + hardstep( intensity ));" //Add lighting and hardstep diffuse light intensity
 	"	gl_FragData[0] = color;"
-	"	gl_FragData[1].rgb = vertexNormal;"
+	"	gl_FragData[1] = encodeGBuffer( normalize( vertexNormal ), eyeDepth );"
 	"}";
 
+// Sobel operator on the normal and depth of the 8 neighbours of a pixel, needs a getData( t )
+// that returns the normal and linear depth at a texture coordinate
+#define SHADER_EDGE_SOBEL \
+	"uniform vec2 texelSize;" \
+	"" \
+	"float getEdge( vec2 t )" \
+	"{" \
+	"	vec4 g00,g01,g02, g10,g12, g20,g21,g22;" \
+	"	g00 = getData( t + texelSize * vec2( -1.0, -1.0 ) ); " \
+	"	g01 = getData( t + texelSize * vec2(  0.0, -1.0 ) ); " \
+	"	g02 = getData( t + texelSize * vec2( +1.0, -1.0 ) ); " \
+	"" \
+	"	g10 = getData( t + texelSize * vec2( -1.0,  0.0 ) ); " \
+	"	g12 = getData( t + texelSize * vec2( +1.0,  0.0 ) ); " \
+	"" \
+	"	g20 = getData( t + texelSize * vec2( -1.0, +1.0 ) ); " \
+	"	g21 = getData( t + texelSize * vec2(  0.0, +1.0 ) ); " \
+	"	g22 = getData( t + texelSize * vec2( +1.0, +1.0 ) ); " \
+	"" \
+	"	vec4 edgeX = g00 + 2.0 * g10 + g20 - g02 - 2.0 * g12 - g22;" \
+	"	vec4 edgeY = g00 + 2.0 * g01 + g02 - g20 - 2.0 * g21 - g22;" \
+	"" \
+	"	vec4 G = edgeX * edgeX + edgeY * edgeY;" \
+	"	float Gm = dot( G, vec4( 0.4 ) );" \
+	"" \
+	"	return max( 1.0 - Gm, 0.1 );" \
+	"}"
+
+// Normal and linear depth from the G-buffer, a single fetch per tap. Taps are clamped to the part
+// of the G-buffer in use, the rest holds stale data of a larger window
+#define SHADER_GBUFFER_DATA \
+	"uniform sampler2D texGBuffer;" \
+	"uniform vec2 texMax;" \
+	"" \
+	SHADER_GBUFFER_DECODE \
+	"" \
+	"vec4 getData( vec2 t )" \
+	"{" \
+	"	return decodeGBuffer( texture2D( texGBuffer, min( t, texMax ) ) );" \
+	"}"
+
+// Full resolution
 const GLchar fragmentShaderEdge[] =
 	"uniform sampler2D texColor;"
-	"uniform sampler2D texNormal;"
-	"uniform sampler2D texDepth;"
 	""
-	"float LinearizeDepth(float z)"
-	"{"
-	"	float n = 0.1;"																	// Camera near
-	"	float f = 10.0;"																// Camera far
-	"	return (2.0 * n) / (f + n - z * (f - n));"
-	"}"
+	SHADER_GBUFFER_DATA
 	""
-	"vec4 getData( vec2 t )"
-	"{"
-	"	vec4 n;"
-	"	n.xyz = -1.0 + texture2D( texNormal, t ).xyz * 2.0;"
-	"	n.w = LinearizeDepth( texture2D( texDepth, t ).x ) * 10;"
-	"	return n;"
-	"}"
+	SHADER_EDGE_SOBEL
 	""
 	"void main( void )"
 	"{"
-	"	vec3 color;"
-	""
 	"	vec3 pixelColor = texture2D( texColor, gl_TexCoord[0].st ).xyz;"
 	""
-	"	float o = 1.0 / 512;"
-	"	vec4 g00,g01,g02, g10,g12, g20,g21,g22;"
-	"	g00 = getData( gl_TexCoord[0].st + vec2( -o, -o ) ); "
-	"	g01 = getData( gl_TexCoord[0].st + vec2(  0, -o ) ); "
-	"	g02 = getData( gl_TexCoord[0].st + vec2( +o, -o ) ); "
-	""
-	"	g10 = getData( gl_TexCoord[0].st + vec2( -o,  0 ) ); "
-	"	g12 = getData( gl_TexCoord[0].st + vec2( +o,  0 ) ); "
+	"	gl_FragColor = vec4( pixelColor * getEdge( gl_TexCoord[0].st ), 1 );"
+	"}";
+
+// Half resolution, writes only the edge intensity
+const GLchar fragmentShaderEdgeHalf[] =
+	SHADER_GBUFFER_DATA
 	""
-	"	g20 = getData( gl_TexCoord[0].st + vec2( -o, +o ) ); "
-	"	g21 = getData( gl_TexCoord[0].st + vec2(  0, +o ) ); "
-	"	g22 = getData( gl_TexCoord[0].st + vec2( +o, +o ) ); "
+	SHADER_EDGE_SOBEL
 	""
-	"	vec4 edgeX = g00 + 2 * g10 + g20 - g02 - 2 * g12 - g22;"
-	"	vec4 edgeY = g00 + 2 * g01 + g02 - g20 - 2 * g21 - g22;"
+	"void main( void )"
+	"{"
+	"	gl_FragColor = vec4( getEdge( gl_TexCoord[0].st ) );"
+	"}";
+
+// Applies the upsampled half resolution edges to the colour
+const GLchar fragmentShaderEdgeComposite[] =
+	"uniform sampler2D texColor;"
+	"uniform sampler2D texEdge;"
 	""
-	"	vec4 G = edgeX * edgeX + edgeY * edgeY;"
-	"	float Gm = dot( G, vec4( 0.4 ) );"
+	"void main( void )"
+	"{"
+	"	vec3 pixelColor = texture2D( texColor, gl_TexCoord[0].st ).xyz;"
+	"	float edge = texture2D( texEdge, gl_TexCoord[0].st ).x;"					// Bilinear upsample
 	""
-	"	float edge = 1.0 - Gm;"
-	"	edge = max( edge, 0.1 );"
-	"	color = pixelColor * edge;"
-	""	
-	"	gl_FragColor = vec4( color, 1 );"
-	"}";
\ No newline at end of file
+	"	gl_FragColor = vec4( pixelColor * edge, 1 );"
+	"}";